@@ -0,0 +1,436 @@
+#include "aot.hpp"
+#include "rom.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef YABGBE_SRC_DIR
+	#define YABGBE_SRC_DIR "src"
+#endif
+
+// Recompiles a ROM ahead of time. Walks all the code it can find from the entry point and the interrupt
+// vectors, cuts it into blocks the same way the JIT would and writes out C++ for them. Compiled into a
+// shared library that can be loaded with --aot, those are there from the first frame on and work on
+// every platform. Whatever wasn't found here (code in RAM, jumps through tables, ...) is left to the
+// interpreter and the JIT
+
+struct Options
+{
+	const char* rom = nullptr;
+	const char* outFile = nullptr;
+	const char* moduleFile = nullptr;
+};
+
+// Somewhere code starts, and which bank we think is in $4000-$7FFF at that point (-1 if no idea)
+struct Location
+{
+	DWORD offset;
+	WORD address;
+	int bank;
+
+	bool operator<(const Location& other) const
+	{
+		return std::tie(offset, address, bank) < std::tie(other.offset, other.address, other.bank);
+	}
+};
+
+struct Instruction
+{
+	WORD address;
+	BYTE bytes[3];
+	InstructionPlan plan;
+};
+
+class Recompiler
+{
+public:
+	Recompiler(const std::vector<BYTE>& data) : data(data)
+	{
+		banks = (int)(data.size() / 0x4000);
+		fixedBank = (banks <= 2) ? 1 : -1;		// No MBC (or nothing to switch to), so bank 1 is all there is
+	}
+
+	void Walk()
+	{
+		// The boot ROM jumps to $0100 with bank 1 mapped. Interrupts could happen with anything mapped
+		Push(0x0100, 1);
+		for (WORD vector = 0x40; vector <= 0x60; vector += 8)
+			Push(vector, fixedBank);
+
+		while (!pending.empty())
+		{
+			Location location = pending.front();
+			pending.pop_front();
+			Follow(location);
+		}
+	}
+
+	void Write(FILE* f, QWORD romHash) const
+	{
+		fprintf(f, "// Generated by yabgbe_aot, don't bother editing this\n");
+		fprintf(f, "#include \"aot.hpp\"\n\n");
+		fprintf(f, "static const AOTRuntime* rt;\n\n");
+
+		for (const auto& [key, instructions] : blocks)
+			WriteBlock(f, key.first, key.second, instructions);
+
+		fprintf(f, "static const AOTBlock blocks[] = {\n");
+		for (const auto& [key, instructions] : blocks)
+			fprintf(f, "\t{ 0x%06x, 0x%04x, Block_%06x_%04x },\n", key.first, key.second, key.first, key.second);
+		fprintf(f, "};\n\n");
+
+		fprintf(f, "AOT_EXPORT const AOTModule* " AOT_ENTRY "(const AOTRuntime* runtime)\n{\n");
+		fprintf(f, "\tstatic const AOTModule module = { AOT_VERSION, 0x%016llxULL, %zu, blocks };\n", romHash, blocks.size());
+		fprintf(f, "\tif (runtime->version != AOT_VERSION)\n\t\treturn nullptr;\n\n");
+		fprintf(f, "\trt = runtime;\n\treturn &module;\n}\n");
+	}
+
+	size_t Blocks() const { return blocks.size(); }
+
+private:
+	void Push(WORD address, int bank)
+	{
+		if (bank < 0)
+			bank = fixedBank;
+
+		// Code in RAM could be anything by the time it runs
+		DWORD offset;
+		if (address < 0x4000)
+			offset = address;
+		else if (address < 0x8000 && bank >= 0)
+			offset = bank * 0x4000 + (address - 0x4000);
+		else
+			return;
+
+		Location location = { offset, address, bank };
+		if (offset < data.size() && visited.insert(location).second)
+			pending.push_back(location);
+	}
+
+	// Cuts one block starting at the given location and queues up everything that comes after it
+	void Follow(const Location& location)
+	{
+		// Code up in the switchable bank obviously knows which one that is
+		int bank = (location.address >= 0x4000) ? (int)(location.offset / 0x4000) : location.bank;
+		int a = -1;			// A, if we know what it is. Bank switches look like LD A, n; LD ($2000), A
+
+		std::vector<Instruction> instructions;
+		WORD addr = location.address;
+		DWORD offset = location.offset;
+		while (true)
+		{
+			// Blocks end at page boundaries, the next page could be a different bank
+			if (instructions.size() >= JIT_MAX_INSTRUCTIONS || (addr >> 8) != (location.address >> 8))
+			{
+				Push(addr, bank);
+				break;
+			}
+
+			Instruction instruction = { };
+			instruction.address = addr;
+			for (int i = 0; i < 3 && offset + i < data.size(); i++)
+				instruction.bytes[i] = data[offset + i];
+
+			instruction.plan = JIT::Classify(instruction.bytes);
+			const InstructionPlan& plan = instruction.plan;
+			if (!plan.valid)
+				break;
+
+			WORD next = addr + plan.length;
+			if (!plan.allowed || (addr & 0xFF) + plan.length > 0x100)
+			{
+				// The interpreter takes care of this one, we continue right after it
+				BYTE op = instruction.bytes[0];
+				WORD target = instruction.bytes[1] | (instruction.bytes[2] << 8);
+				if (op == 0xEA && target >= 0x2000 && target < 0x4000)
+					bank = (a < 0) ? -1 : std::max(1, (a & 0x1F) % banks);
+
+				if (plan.terminal)
+					Successors(instruction, bank);
+				else
+					Push(next, bank);
+				break;
+			}
+
+			a = (instruction.bytes[0] == 0x3E) ? instruction.bytes[1] : -1;
+			instructions.push_back(instruction);
+
+			if (plan.terminal)
+			{
+				Successors(instruction, bank);
+				break;
+			}
+
+			addr = next;
+			offset += plan.length;
+		}
+
+		if (!instructions.empty())
+			blocks.emplace(std::make_pair(location.offset, location.address), std::move(instructions));
+	}
+
+	// Where control flow can go after a jump/call/ret/...
+	void Successors(const Instruction& instruction, int bank)
+	{
+		BYTE op = instruction.bytes[0];
+		WORD nn = instruction.bytes[1] | (instruction.bytes[2] << 8);
+		WORD next = instruction.address + instruction.plan.length;
+
+		bool fallsThrough = true;
+		if (op == 0x18 || (op & 0xE7) == 0x20)		// JR, JR cc
+		{
+			Push(next + (int8_t)instruction.bytes[1], bank);
+			fallsThrough = (op != 0x18);
+		}
+		else if (op == 0xC3 || (op & 0xE7) == 0xC2)	// JP, JP cc
+		{
+			Push(nn, bank);
+			fallsThrough = (op != 0xC3);
+		}
+		else if (op == 0xCD || (op & 0xE7) == 0xC4)	// CALL, CALL cc
+			Push(nn, bank);
+		else if ((op & 0xC7) == 0xC7)				// RST
+			Push(op & 0x38, bank);
+		else if (op == 0xC9 || op == 0xD9 || op == 0xE9)	// RET, RETI, JP HL
+			fallsThrough = false;
+
+		// Everything else (RET cc, HALT, STOP, EI, DI) just keeps going
+		if (fallsThrough)
+			Push(next, bank);
+	}
+
+	// C++ for what the instruction does, if it's one of those that get translated (see JIT::Classify()). The
+	// address for memory accesses is already in addr by then
+	static void WriteInstruction(FILE* f, const Instruction& instruction)
+	{
+		static const char* r[8] = { "cpu->BC.b.hi", "cpu->BC.b.lo", "cpu->DE.b.hi", "cpu->DE.b.lo", "cpu->HL.b.hi", "cpu->HL.b.lo", nullptr, "cpu->AF.b.hi" };
+		static const char* rp[4] = { "cpu->BC.w", "cpu->DE.w", "cpu->HL.w", "cpu->SP.w" };
+		static const char* aluOps[8] = { "+", "+", "-", "-", "&", "^", "|", "-" };
+		static const char* aluFlags[8] = { "FLAGS_ADD", "FLAGS_ADC", "FLAGS_SUB", "FLAGS_SBC", "FLAGS_AND", "FLAGS_LOGIC", "FLAGS_LOGIC", "FLAGS_SUB" };
+
+		const BYTE* bytes = instruction.bytes;
+		BYTE op = bytes[0];
+		BYTE x = op >> 6, y = (op >> 3) & 0x7, z = op & 0x7;
+		BYTE p = y >> 1, q = y & 0x1;
+		WORD nn = bytes[1] | (bytes[2] << 8);
+
+		// Reading and writing an 8 bit operand, (HL) included
+		auto operand = [&](BYTE reg) { return (reg == 6) ? std::string("AOTRead(rt, cpu, addr)") : std::string(r[reg]); };
+		auto store = [&](BYTE reg, const std::string& val)
+		{
+			if (reg == 6)
+				fprintf(f, "\t\tAOTWrite(rt, cpu, addr, %s);\n", val.c_str());
+			else
+				fprintf(f, "\t\t%s = %s;\n", r[reg], val.c_str());
+		};
+
+		if (op == 0x00)											// NOP
+			return;
+		else if (x == 0 && z == 1)								// LD rr, nn
+			fprintf(f, "\t\t%s = 0x%04x;\n", rp[p], nn);
+		else if (x == 0 && z == 2)								// LD (rr), A and LD A, (rr)
+		{
+			if (q == 0)
+				fprintf(f, "\t\tAOTWrite(rt, cpu, addr, cpu->AF.b.hi);\n");
+			else
+				fprintf(f, "\t\tcpu->AF.b.hi = AOTRead(rt, cpu, addr);\n");
+
+			if (p >= 2)
+				fprintf(f, "\t\tcpu->HL.w%s;\n", (p == 2) ? "++" : "--");
+		}
+		else if (x == 0 && z == 3)								// INC/DEC rr
+			fprintf(f, "\t\t%s%s;\n", rp[p], q ? "--" : "++");
+		else if (x == 0 && (z == 4 || z == 5))					// INC/DEC r
+		{
+			const char* sign = (z == 4) ? "+" : "-";
+			fprintf(f, "\t\tBYTE val = %s;\n", operand(y).c_str());
+			fprintf(f, "\t\tAOTDefer(cpu, %s, val, 1, val %s 1, cpu->CarryFlag());\n", (z == 4) ? "FLAGS_INC" : "FLAGS_DEC", sign);
+			store(y, std::string("val ") + sign + " 1");
+		}
+		else if (x == 0 && z == 6)								// LD r, n
+		{
+			char val[8];
+			snprintf(val, sizeof(val), "0x%02x", bytes[1]);
+			store(y, val);
+		}
+		else if (x == 1)										// LD r, r
+			store(y, operand(z));
+		else if (x == 2 || (x == 3 && z == 6))					// ALU
+		{
+			char immediate[8];
+			snprintf(immediate, sizeof(immediate), "0x%02x", bytes[1]);
+			bool carry = (y == 1 || y == 3);
+
+			fprintf(f, "\t\tBYTE a = cpu->AF.b.hi;\n");
+			fprintf(f, "\t\tBYTE val = %s;\n", (x == 2) ? operand(z).c_str() : immediate);
+			if (carry)
+				fprintf(f, "\t\tBYTE carry = cpu->CarryFlag();\n");
+
+			fprintf(f, "\t\tBYTE result = a %s val%s;\n", aluOps[y], carry ? (std::string(" ") + aluOps[y] + " carry").c_str() : "");
+			fprintf(f, "\t\tAOTDefer(cpu, %s, a, val, result, %s);\n", aluFlags[y], carry ? "carry" : "0");
+			if (y != 7)											// CP forgets the result
+				fprintf(f, "\t\tcpu->AF.b.hi = result;\n");
+		}
+		else if (op == 0xEA)									// LD (nn), A
+			fprintf(f, "\t\tAOTWrite(rt, cpu, addr, cpu->AF.b.hi);\n");
+		else													// LD A, (nn)
+			fprintf(f, "\t\tcpu->AF.b.hi = AOTRead(rt, cpu, addr);\n");
+	}
+
+	// Same thing the JIT emits, except as C++. See JIT::Compile(). Instructions that aren't translated
+	// are handed to the interpreter's handler through the runtime
+	static void WriteBlock(FILE* f, DWORD offset, WORD address, const std::vector<Instruction>& instructions)
+	{
+		static const char* pointers[4] = { "cpu->BC.w", "cpu->DE.w", "cpu->HL.w", "cpu->HL.w" };
+
+		fprintf(f, "static DWORD Block_%06x_%04x(CPU* cpu, BlockContext* context)\n{\n", offset, address);
+		fprintf(f, "\tQWORD at = 0;\n\tDWORD count = 0;\n\tBYTE cycles = cpu->cycles;\n\tWORD pc = cpu->PC.w;\n\n");
+
+		for (size_t i = 0; i < instructions.size(); i++)
+		{
+			const Instruction& instruction = instructions[i];
+			const InstructionPlan& plan = instruction.plan;
+			const BYTE* bytes = instruction.bytes;
+
+			fprintf(f, "\t{\t\t// $%04x: %02x", instruction.address, bytes[0]);
+			for (BYTE j = 1; j < plan.length; j++)
+				fprintf(f, " %02x", bytes[j]);
+			fprintf(f, "\n");
+
+			if (i > 0)
+				fprintf(f, "\t\tif (at + cycles + 1 > context->budget)\n\t\t\tgoto done;\n");
+
+			// Plain memory is in the page tables, only the rest needs a closer look
+			if (plan.access != ACCESS_NONE)
+			{
+				if (bytes[0] == 0xEA || bytes[0] == 0xFA)
+					fprintf(f, "\t\tWORD addr = 0x%04x;\n", bytes[1] | (bytes[2] << 8));
+				else
+					fprintf(f, "\t\tWORD addr = %s;\n", ((bytes[0] & 0xC7) == 0x02) ? pointers[bytes[0] >> 4] : "cpu->HL.w");
+
+				if (plan.guard != GUARD_NONE)
+					fprintf(f, "\t\tif (cpu->bus->%s[addr >> 8] == nullptr && !rt->guard(cpu, %u, 0x%04x))\n\t\t\tgoto done;\n",
+						(plan.access == ACCESS_READ) ? "readPages" : "writePages", plan.guard, plan.addr);
+			}
+			else if (plan.guard != GUARD_NONE)
+				fprintf(f, "\t\tif (!rt->guard(cpu, %u, 0x%04x))\n\t\t\tgoto done;\n", plan.guard, plan.addr);
+
+			if (i > 0)
+				fprintf(f, "\t\tat += cycles + 1;\n");
+
+			if (plan.native)
+			{
+				WriteInstruction(f, instruction);
+				fprintf(f, "\t\tcycles = %u;\n\t\tpc = 0x%04x;\n", plan.cycles, (WORD)(instruction.address + plan.length));
+			}
+			else
+			{
+				if (plan.terminal)
+					fprintf(f, "\t\t*context->counter = context->start + at;\n");
+
+				fprintf(f, "\t\tstatic const BYTE code[] = { 0x%02x, 0x%02x, 0x%02x };\n", bytes[0], bytes[1], bytes[2]);
+				fprintf(f, "\t\tcycles = rt->execute(cpu, 0x%04x, code);\n\t\tpc = cpu->PC.w;\n", instruction.address);
+			}
+
+			fprintf(f, "\t\tcount++;\n\t}\n\n");
+		}
+
+		// A block with a single instruction and nothing to check never bails out early
+		bool exits = (instructions.size() > 1 || instructions[0].plan.guard != GUARD_NONE);
+		fprintf(f, "%s\tcpu->PC.w = pc;\n\tcpu->cycles = cycles;\n\tcontext->last = at;\n\treturn count;\n}\n\n", exits ? "done:\n" : "");
+	}
+
+private:
+	const std::vector<BYTE>& data;
+	int banks;
+	int fixedBank;
+
+	std::deque<Location> pending;
+	std::set<Location> visited;
+	std::map<std::pair<DWORD, WORD>, std::vector<Instruction>> blocks;		// By ROM offset and address
+};
+
+static void PrintUsage()
+{
+	fprintf(stderr, "Usage: yabgbe_aot [--out FILE.cpp] [--module FILE] <ROM>\n");
+	fprintf(stderr, "--module compiles the generated code with $CXX (or c++) into a module for --aot\n");
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	for (int i = 1; i < argc; i++)
+	{
+		bool hasValue = (i + 1 < argc);
+
+		if (!strcmp(argv[i], "--out") && hasValue)
+			options.outFile = argv[++i];
+		else if (!strcmp(argv[i], "--module") && hasValue)
+			options.moduleFile = argv[++i];
+		else if (argv[i][0] != '-' && options.rom == nullptr)
+			options.rom = argv[i];
+		else
+		{
+			PrintUsage();
+			return -1;
+		}
+	}
+
+	if (options.rom == nullptr)
+	{
+		PrintUsage();
+		return -1;
+	}
+
+	FILE* f = fopen(options.rom, "rb");
+	if (f == nullptr)
+	{
+		EXIT_MSG("Failed to open %s", options.rom);
+		return -1;
+	}
+
+	ROM rom(f);
+	fclose(f);
+
+	Recompiler recompiler(rom.Data());
+	recompiler.Walk();
+
+	// The module needs the source somewhere, so make one up if nobody said where
+	std::string source = (options.outFile != nullptr) ? options.outFile : "";
+	if (source.empty() && options.moduleFile != nullptr)
+		source = std::string(options.moduleFile) + ".cpp";
+
+	FILE* out = source.empty() ? stdout : fopen(source.c_str(), "w");
+	if (out == nullptr)
+	{
+		EXIT_MSG("Failed to open %s", source.c_str());
+		return -1;
+	}
+
+	recompiler.Write(out, rom.Hash());
+	if (out != stdout)
+		fclose(out);
+
+	fprintf(stderr, "Found %zu blocks\n", recompiler.Blocks());
+
+	if (options.moduleFile != nullptr)
+	{
+		const char* compiler = getenv("CXX");
+		std::string command = std::string(compiler ? compiler : "c++") + " -std=c++17 -O2 -shared -fPIC -I \"" YABGBE_SRC_DIR "\" \"" + source + "\" -o \"" + options.moduleFile + "\"";
+		fprintf(stderr, "%s\n", command.c_str());
+		if (system(command.c_str()) != 0)
+		{
+			fprintf(stderr, "Compiling the module failed\n");
+			return 1;
+		}
+	}
+
+	return 0;
+}
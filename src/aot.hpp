@@ -0,0 +1,75 @@
+#pragma once
+
+#include "bus.hpp"
+
+// Everything a module generated by yabgbe_aot and the emulator need to agree on. The module
+// doesn't link against the emulator at all, whatever it needs from it comes in through AOTRuntime.
+// It does work on the CPU's registers and the bus' page tables directly though, so it has to be
+// made again whenever those move around
+
+#define AOT_VERSION		2			// Bump this whenever anything in here (or BlockContext, CPU, Bus) changes
+#define AOT_ENTRY		"yabgbe_aot_module"
+
+#ifdef _WIN32
+	#define AOT_EXPORT extern "C" __declspec(dllexport)
+#else
+	#define AOT_EXPORT extern "C" __attribute__((visibility("default")))
+#endif
+
+struct AOTRuntime
+{
+	DWORD version;
+	bool (*guard)(CPU* cpu, BYTE guard, WORD addr);			// JIT::Guard()
+	BYTE (*execute)(CPU* cpu, WORD addr, const BYTE* bytes);	// JIT::Execute()
+	BYTE (*read)(CPU* cpu, WORD addr);						// Bus::Read() and Bus::Write(), for
+	void (*write)(CPU* cpu, WORD addr, BYTE val);			// what the page tables don't have
+};
+
+struct AOTBlock
+{
+	DWORD offset;			// Where the first instruction is in the ROM file
+	WORD address;			// And where it's mapped when it runs
+	BlockCode code;
+};
+
+struct AOTModule
+{
+	DWORD version;
+	QWORD romHash;			// ROM::Hash() of what this was generated from
+	DWORD count;
+	const AOTBlock* blocks;
+};
+
+typedef const AOTModule* (*AOTEntry)(const AOTRuntime* runtime);
+
+// What the generated code uses for the instructions it translated. Plain memory is right there in the
+// page tables, the rest (WRAM with code in it, HRAM) goes through the bus. The guard already made sure
+// that it's nothing anybody would notice
+inline BYTE AOTRead(const AOTRuntime* rt, CPU* cpu, WORD addr)
+{
+	const BYTE* page = cpu->bus->readPages[addr >> 8];
+	return (page != nullptr) ? page[addr & 0xFF] : rt->read(cpu, addr);
+}
+
+inline void AOTWrite(const AOTRuntime* rt, CPU* cpu, WORD addr, BYTE val)
+{
+	BYTE* page = cpu->bus->writePages[addr >> 8];
+	if (page == nullptr)
+	{
+		rt->write(cpu, addr, val);
+		return;
+	}
+
+	cpu->bus->writes++;
+	page[addr & 0xFF] = val;
+}
+
+// Same as CPU::DeferFlags()
+inline void AOTDefer(CPU* cpu, BYTE op, BYTE a, BYTE b, BYTE result, BYTE carry)
+{
+	cpu->lazyFlags.op = op;
+	cpu->lazyFlags.a = a;
+	cpu->lazyFlags.b = b;
+	cpu->lazyFlags.result = result;
+	cpu->lazyFlags.carry = carry;
+}
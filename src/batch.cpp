@@ -0,0 +1,349 @@
+#include "bus.hpp"
+#include "input.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <string.h>
+
+// One emulation to run. Lines in the job file look like this
+//
+//		# rom            frames   [input script]
+//		res/tetris.gb    1200
+//		res/tetris.gb    1500     scripts/start_game.txt
+//
+struct Job
+{
+	std::string rom;
+	QWORD frames;
+	std::string input;		// Empty if there is no input script
+};
+
+struct JobResult
+{
+	bool ok = false;
+	QWORD frames = 0;
+	QWORD cycles = 0;
+	double seconds = 0.0;
+	QWORD displayHash = 0;
+	bool invalid = false;
+	int worker = -1;
+
+#ifdef OPCODE_STATS
+	OpcodeStats opcodes;
+#endif
+};
+
+struct Options
+{
+	const char* jobFile = nullptr;
+	const char* outFile = nullptr;
+	int threads = 0;		// 0 means one per core
+	bool jit = false;
+	bool scanline = false;	// Draw whole lines at once, see LCD::scanlineRenderer
+	WORD frameSkip = 0;		// Frames to skip after every drawn one. The last ones always get drawn
+	const char* opcodeFile = nullptr;		// All jobs' opcode counts added up. Needs OPCODE_STATS
+};
+
+// Every worker has its own queue and eats from the back of it. Once it's empty the worker
+// goes and steals from the front of someone else's queue. Jobs don't spawn new jobs, so
+// if a worker can't find anything anywhere then we're done
+class WorkStealingPool
+{
+public:
+	WorkStealingPool(size_t workers) : queues(workers) { }
+
+	void Push(size_t worker, size_t job)
+	{
+		Queue& queue = queues[worker % queues.size()];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.jobs.push_back(job);
+	}
+
+	bool Take(size_t worker, size_t& job)
+	{
+		// Own queue first
+		{
+			Queue& queue = queues[worker];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (!queue.jobs.empty())
+			{
+				job = queue.jobs.back();
+				queue.jobs.pop_back();
+				return true;
+			}
+		}
+
+		// Then go around and steal
+		for (size_t i = 1; i < queues.size(); i++)
+		{
+			Queue& victim = queues[(worker + i) % queues.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex);
+			if (!victim.jobs.empty())
+			{
+				job = victim.jobs.front();
+				victim.jobs.pop_front();
+				steals++;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	QWORD Steals() const { return steals; }
+
+private:
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<size_t> jobs;
+	};
+
+	std::vector<Queue> queues;
+	std::atomic<QWORD> steals = { 0 };
+};
+
+static bool LoadJobs(const char* filename, std::vector<Job>& jobs)
+{
+	FILE* f = fopen(filename, "rb");
+	if (f == nullptr)
+		return false;
+
+	char line[1024];
+	int lineNumber = 0;
+	while (fgets(line, sizeof(line), f))
+	{
+		lineNumber++;
+
+		char* comment = strchr(line, '#');
+		if (comment != nullptr)
+			*comment = '\0';
+
+		char rom[512], input[512];
+		unsigned long long frames;
+		int fields = sscanf(line, "%511s %llu %511s", rom, &frames, input);
+		if (fields <= 0)		// Empty line
+			continue;
+
+		if (fields < 2)
+		{
+			fprintf(stderr, "%s:%d: expected <rom> <frames> [input script]\n", filename, lineNumber);
+			fclose(f);
+			return false;
+		}
+
+		jobs.push_back({ rom, frames, (fields == 3) ? input : "" });
+	}
+
+	fclose(f);
+	return true;
+}
+
+// Each job gets its own set of devices, nothing in the core is shared between them
+static void RunJob(const Job& job, const Options& options, JobResult& result)
+{
+	FILE* f = fopen(job.rom.c_str(), "rb");
+	if (f == nullptr)
+		return;
+
+	InputScript input;
+	if (!job.input.empty() && !input.Load(job.input.c_str()))
+	{
+		fclose(f);
+		return;
+	}
+
+	Bus bus;
+	CPU cpu;
+	LCD lcd;
+
+	bus.AttachCPU(cpu);
+	bus.AttachLCD(lcd);
+
+	ROM rom(f);
+	bus.InsertROM(rom);
+	fclose(f);
+
+	cpu.Powerup();
+	cpu.jit.enabled = options.jit;
+	lcd.scanlineRenderer = options.scanline;
+
+	auto start = std::chrono::steady_clock::now();
+	QWORD frame = 0;
+	for (; frame < job.frames && !bus.invalid; frame++)
+	{
+		input.Apply(bus, frame);
+
+		// Frame() can end up a bit into the next frame, so stop skipping two frames early to get a proper picture at the end
+		lcd.frameSkip = (frame + 2 < job.frames) ? options.frameSkip : 0;
+		bus.Frame();
+	}
+
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	result.frames = frame;
+	result.cycles = bus.internalCounter;
+	result.displayHash = lcd.DisplayHash();
+	result.invalid = bus.invalid;
+	result.ok = true;
+
+#ifdef OPCODE_STATS
+	result.opcodes = cpu.opcodeStats;
+#endif
+}
+
+static void WriteResults(FILE* f, const std::vector<Job>& jobs, const std::vector<JobResult>& results, int threads, double wallSeconds, QWORD steals)
+{
+	QWORD frames = 0, cycles = 0, failed = 0;
+	double jobSeconds = 0.0;
+
+	fprintf(f, "{\n\t\"jobs\": [\n");
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		const JobResult& r = results[i];
+		fprintf(f, "\t\t{\"rom\": \"%s\", \"input\": \"%s\", \"ok\": %s, ", jobs[i].rom.c_str(), jobs[i].input.c_str(), r.ok ? "true" : "false");
+		fprintf(f, "\"frames\": %llu, \"cycles\": %llu, \"seconds\": %.6f, \"display_hash\": \"%016llx\", \"invalid\": %s, \"worker\": %d}%s\n",
+			r.frames, r.cycles, r.seconds, r.displayHash, r.invalid ? "true" : "false", r.worker, (i + 1 < jobs.size()) ? "," : "");
+
+		frames += r.frames;
+		cycles += r.cycles;
+		jobSeconds += r.seconds;
+		failed += !r.ok;
+	}
+	fprintf(f, "\t],\n");
+
+	fprintf(f, "\t\"total\": {\"jobs\": %zu, \"failed\": %llu, \"threads\": %d, \"steals\": %llu, \"wall_seconds\": %.6f, \"job_seconds\": %.6f, ",
+		jobs.size(), failed, threads, steals, wallSeconds, jobSeconds);
+	fprintf(f, "\"jobs_per_second\": %.2f, \"frames_per_second\": %.2f, \"cycles_per_second\": %.0f}\n}\n",
+		jobs.size() / wallSeconds, frames / wallSeconds, cycles / wallSeconds);
+}
+
+static void PrintUsage()
+{
+	fprintf(stderr, "Usage: yabgbe_batch [--threads N] [--out FILE] [--jit] [--scanline] [--frame-skip N] [--opcode-stats FILE] <job file>\n");
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	for (int i = 1; i < argc; i++)
+	{
+		bool hasValue = (i + 1 < argc);
+
+		if (!strcmp(argv[i], "--threads") && hasValue)
+			options.threads = std::max(0, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "--out") && hasValue)
+			options.outFile = argv[++i];
+		else if (!strcmp(argv[i], "--jit"))
+			options.jit = true;
+		else if (!strcmp(argv[i], "--scanline"))
+			options.scanline = true;
+		else if (!strcmp(argv[i], "--frame-skip") && hasValue)
+			options.frameSkip = (WORD)strtoul(argv[++i], nullptr, 10);
+		else if (!strcmp(argv[i], "--opcode-stats") && hasValue)
+			options.opcodeFile = argv[++i];
+		else if (argv[i][0] != '-' && options.jobFile == nullptr)
+			options.jobFile = argv[i];
+		else
+		{
+			PrintUsage();
+			return -1;
+		}
+	}
+
+	if (options.jobFile == nullptr)
+	{
+		PrintUsage();
+		return -1;
+	}
+
+#ifndef OPCODE_STATS
+	if (options.opcodeFile != nullptr)
+	{
+		fprintf(stderr, "--opcode-stats needs a build with OPCODE_STATS (YABGBE_OPCODE_STATS in CMake)\n");
+		return -1;
+	}
+#endif
+
+	std::vector<Job> jobs;
+	if (!LoadJobs(options.jobFile, jobs))
+	{
+		EXIT_MSG("Failed to load jobs from %s", options.jobFile);
+		return -1;
+	}
+
+	int threads = options.threads;
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+
+	// Deal the jobs out like cards. Whoever runs out first helps the others
+	WorkStealingPool pool(threads);
+	for (size_t i = 0; i < jobs.size(); i++)
+		pool.Push(i, i);
+
+	std::vector<JobResult> results(jobs.size());
+	std::atomic<size_t> done = { 0 };
+
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> workers;
+	for (int w = 0; w < threads; w++)
+	{
+		workers.emplace_back([&, w]()
+		{
+			size_t job;
+			while (pool.Take(w, job))
+			{
+				RunJob(jobs[job], options, results[job]);
+				results[job].worker = w;
+
+				if (!results[job].ok)
+					fprintf(stderr, "Job %zu (%s) failed\n", job, jobs[job].rom.c_str());
+
+				done++;
+			}
+		});
+	}
+
+	for (std::thread& worker : workers)
+		worker.join();
+
+	double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	fprintf(stderr, "Ran %zu jobs on %d threads in %.3f s (%.2f jobs/s)\n", done.load(), threads, wallSeconds, jobs.size() / wallSeconds);
+
+	FILE* out = stdout;
+	if (options.outFile != nullptr)
+	{
+		out = fopen(options.outFile, "w");
+		if (out == nullptr)
+		{
+			EXIT_MSG("Failed to open %s", options.outFile);
+			return -1;
+		}
+	}
+
+	WriteResults(out, jobs, results, threads, wallSeconds, pool.Steals());
+
+	if (out != stdout)
+		fclose(out);
+
+#ifdef OPCODE_STATS
+	if (options.opcodeFile != nullptr)
+	{
+		OpcodeStats total;
+		for (const JobResult& result : results)
+			total.Add(result.opcodes);
+
+		if (!total.Save(options.opcodeFile))
+			return -1;
+	}
+#endif
+
+	bool failed = std::any_of(results.begin(), results.end(), [](const JobResult& r) { return !r.ok; });
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,287 @@
+#include "bus.hpp"
+#include "input.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <string.h>
+
+#ifndef YABGBE_RES_DIR
+	#define YABGBE_RES_DIR "res"
+#endif
+
+// A fixed thing to run. Always the same, so that the numbers mean something
+struct Scenario
+{
+	const char* name;
+	const char* rom;
+	QWORD frames;
+	const char* input;		// Input script (see input.hpp), or nullptr for no input at all
+};
+
+// Tetris only listens to the joypad once the title screen is up (around frame 950), so the
+// input scenario starts a game from there and fiddles with the first piece
+static const Scenario scenarios[] = {
+	{ "tetris_boot",	"tetris.gb",		1200,	nullptr },
+	{ "tetris_input",	"tetris.gb",		1500,	"1000 S\n1006 -\n1040 S\n1046 -\n1080 S\n1086 -\n1120 S\n1126 -\n1200 L\n1220 -\n1240 R\n1260 -\n1280 A\n1284 -\n1300 D\n1400 -\n" },
+	{ "mario_boot",		"mario.gb",			400,	nullptr },	// Mario trips over an unimplemented opcode a bit after this
+	{ "cpu_instrs",		"cpu_instrs.gb",	1500,	nullptr },
+};
+
+struct Result
+{
+	const Scenario* scenario;
+	QWORD frames;
+	QWORD cycles;
+	QWORD instructions;
+	double seconds;
+	double frameP50, frameP99;		// in microseconds
+	QWORD displayHash;
+	bool invalid;
+
+	// Only there if we compare against a baseline
+	double baselineNsPerCycle = 0.0;
+	bool regression = false;
+};
+
+struct Options
+{
+	std::string resDir = YABGBE_RES_DIR;
+	const char* filter = nullptr;
+	const char* outFile = nullptr;
+	const char* baselineFile = nullptr;
+	double tolerance = 5.0;		// in percent
+	int runs = 3;
+	bool jit = false;
+	bool scanline = false;
+};
+
+static double Percentile(std::vector<double> values, double p)
+{
+	if (values.empty())
+		return 0.0;
+
+	size_t idx = (size_t)(p * (values.size() - 1));
+	std::nth_element(values.begin(), values.begin() + idx, values.end());
+	return values[idx];
+}
+
+static bool RunScenario(const Scenario& scenario, const Options& options, Result& result)
+{
+	std::string path = options.resDir + "/" + scenario.rom;
+	FILE* f = fopen(path.c_str(), "rb");
+	if (f == nullptr)
+	{
+		EXIT_MSG("Failed to open %s", path.c_str());
+		return false;
+	}
+
+	// Just pick the fastest run, everything else is noise from the host
+	result.scenario = &scenario;
+	result.seconds = -1.0;
+	for (int run = 0; run < options.runs; run++)
+	{
+		rewind(f);
+
+		Bus bus;
+		CPU cpu;
+		LCD lcd;
+
+		bus.AttachCPU(cpu);
+		bus.AttachLCD(lcd);
+
+		ROM rom(f);
+		bus.InsertROM(rom);
+
+		cpu.Powerup();
+		cpu.jit.enabled = options.jit;
+		lcd.scanlineRenderer = options.scanline;
+
+		InputScript input;
+		if (scenario.input != nullptr && !input.Parse(scenario.input))
+		{
+			EXIT_MSG("Scenario %s has a broken input script", scenario.name);
+			fclose(f);
+			return false;
+		}
+
+		std::vector<double> frameTimes;
+		frameTimes.reserve(scenario.frames);
+
+		QWORD frame = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (; frame < scenario.frames && !bus.invalid; frame++)
+		{
+			auto frameStart = std::chrono::steady_clock::now();
+
+			input.Apply(bus, frame);
+			bus.Frame();
+
+			frameTimes.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - frameStart).count());
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		if (result.seconds < 0.0 || seconds < result.seconds)
+		{
+			result.frames = frame;
+			result.cycles = bus.internalCounter;
+			result.instructions = cpu.instructions;
+			result.seconds = seconds;
+			result.frameP50 = Percentile(frameTimes, 0.50);
+			result.frameP99 = Percentile(frameTimes, 0.99);
+			result.displayHash = lcd.DisplayHash();
+			result.invalid = bus.invalid;
+		}
+	}
+
+	fclose(f);
+	return true;
+}
+
+// Reads the ns per cycle of every scenario out of a file that was written by this program. This is
+// not a JSON parser, it only understands our own output (one scenario per line)
+static bool LoadBaseline(const char* filename, std::vector<std::pair<std::string, double>>& baseline)
+{
+	FILE* f = fopen(filename, "rb");
+	if (f == nullptr)
+		return false;
+
+	char line[1024];
+	while (fgets(line, sizeof(line), f))
+	{
+		const char* name = strstr(line, "\"name\": \"");
+		const char* nsPerCycle = strstr(line, "\"ns_per_cycle\": ");
+		if (name == nullptr || nsPerCycle == nullptr)
+			continue;
+
+		name += strlen("\"name\": \"");
+		const char* nameEnd = strchr(name, '"');
+		if (nameEnd == nullptr)
+			continue;
+
+		baseline.emplace_back(std::string(name, nameEnd), atof(nsPerCycle + strlen("\"ns_per_cycle\": ")));
+	}
+
+	fclose(f);
+	return true;
+}
+
+static void WriteResults(FILE* f, const std::vector<Result>& results, bool withBaseline)
+{
+	fprintf(f, "{\n\t\"scenarios\": [\n");
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const Result& r = results[i];
+		fprintf(f, "\t\t{\"name\": \"%s\", \"rom\": \"%s\", \"frames\": %llu, \"cycles\": %llu, \"seconds\": %.6f, ",
+			r.scenario->name, r.scenario->rom, r.frames, r.cycles, r.seconds);
+		fprintf(f, "\"fps\": %.2f, \"ns_per_cycle\": %.4f, \"instructions\": %llu, \"instructions_per_second\": %.0f, \"frame_us_p50\": %.2f, \"frame_us_p99\": %.2f, ",
+			r.frames / r.seconds, r.seconds * 1e9 / r.cycles, r.instructions, r.instructions / r.seconds, r.frameP50, r.frameP99);
+		fprintf(f, "\"display_hash\": \"%016llx\", \"invalid\": %s", r.displayHash, r.invalid ? "true" : "false");
+
+		if (withBaseline)
+		{
+			fprintf(f, ", \"baseline_ns_per_cycle\": %.4f, \"regression\": %s",
+				r.baselineNsPerCycle, r.regression ? "true" : "false");
+		}
+
+		fprintf(f, "}%s\n", (i + 1 < results.size()) ? "," : "");
+	}
+	fprintf(f, "\t]\n}\n");
+}
+
+static void PrintUsage()
+{
+	fprintf(stderr, "Usage: yabgbe_bench [--res DIR] [--runs N] [--filter NAME] [--out FILE] [--baseline FILE] [--tolerance PERCENT] [--jit] [--scanline]\n");
+	fprintf(stderr, "Scenarios:\n");
+	for (const Scenario& scenario : scenarios)
+		fprintf(stderr, "\t%-16s %s, %llu frames%s\n", scenario.name, scenario.rom, scenario.frames, scenario.input ? ", scripted input" : "");
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	for (int i = 1; i < argc; i++)
+	{
+		bool hasValue = (i + 1 < argc);
+
+		if (!strcmp(argv[i], "--res") && hasValue)
+			options.resDir = argv[++i];
+		else if (!strcmp(argv[i], "--runs") && hasValue)
+			options.runs = std::max(1, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "--filter") && hasValue)
+			options.filter = argv[++i];
+		else if (!strcmp(argv[i], "--out") && hasValue)
+			options.outFile = argv[++i];
+		else if (!strcmp(argv[i], "--baseline") && hasValue)
+			options.baselineFile = argv[++i];
+		else if (!strcmp(argv[i], "--tolerance") && hasValue)
+			options.tolerance = atof(argv[++i]);
+		else if (!strcmp(argv[i], "--jit"))
+			options.jit = true;
+		else if (!strcmp(argv[i], "--scanline"))
+			options.scanline = true;
+		else
+		{
+			PrintUsage();
+			return -1;
+		}
+	}
+
+	std::vector<std::pair<std::string, double>> baseline;
+	if (options.baselineFile != nullptr && !LoadBaseline(options.baselineFile, baseline))
+	{
+		EXIT_MSG("Failed to load baseline %s", options.baselineFile);
+		return -1;
+	}
+
+	std::vector<Result> results;
+	bool regression = false;
+	for (const Scenario& scenario : scenarios)
+	{
+		if (options.filter != nullptr && strstr(scenario.name, options.filter) == nullptr)
+			continue;
+
+		Result result;
+		if (!RunScenario(scenario, options, result))
+			return -1;
+
+		double nsPerCycle = result.seconds * 1e9 / result.cycles;
+		fprintf(stderr, "%-16s %8.1f frames/s  %7.3f ns/cycle  %7.2f MIPS  p50 %8.1f us  p99 %8.1f us",
+			scenario.name, result.frames / result.seconds, nsPerCycle, result.instructions / result.seconds / 1e6, result.frameP50, result.frameP99);
+
+		for (const auto& entry : baseline)
+		{
+			if (entry.first != scenario.name)
+				continue;
+
+			double change = (nsPerCycle / entry.second - 1.0) * 100.0;
+			result.baselineNsPerCycle = entry.second;
+			result.regression = (change > options.tolerance);
+			regression |= result.regression;
+
+			fprintf(stderr, "  %+6.1f%%%s", change, result.regression ? "  REGRESSION" : "");
+		}
+
+		fprintf(stderr, "\n");
+		results.push_back(result);
+	}
+
+	FILE* out = stdout;
+	if (options.outFile != nullptr)
+	{
+		out = fopen(options.outFile, "w");
+		if (out == nullptr)
+		{
+			EXIT_MSG("Failed to open %s", options.outFile);
+			return -1;
+		}
+	}
+
+	WriteResults(out, results, !baseline.empty());
+
+	if (out != stdout)
+		fclose(out);
+
+	return regression ? 1 : 0;
+}
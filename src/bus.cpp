@@ -2,14 +2,24 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <algorithm>
 
 static WORD timerModuloLookup[4] = { 1024, 16, 64, 256 };
 
+// $E000-$FDFF is just WRAM again, so both of them have to end up at the same address
+static inline WORD UnmirrorWRAM(WORD addr)
+{
+	return (addr >= 0xC000 && addr < 0xFE00) ? (0xC000 | (addr & 0x1FFF)) : addr;
+}
+
 Bus::Bus()
 {
 	// These are some default initializatsrions? We dont *necessarily* need them but eh, who cares
 	invalid = 0;
 	dmg_rom = 0;
+	div = 0;
+	tima = 0;
+	tma = 0;
 	tac.b = 0;
 	joypadReg.b = 0xFF;
 
@@ -21,6 +31,10 @@ Bus::Bus()
 	joypad.left = true;
 	joypad.start = true;
 	joypad.select = true;
+
+	rom = nullptr;
+	cpu = nullptr;
+	MapPages();
 }
 
 Bus::~Bus()
@@ -40,46 +54,119 @@ void Bus::AttachLCD(LCD& l)
 	l.bus = this;
 
 	lcd->Setup();
+
+	// The LCD figures out when it wants to be looked at again once it ran for the first time
+	scheduler.Schedule(Event::LCD, internalCounter + 1);
 }
 
 void Bus::InsertROM(ROM& r)
 {
 	rom = &r;
 	r.bus = this;
+
+	// Compiled blocks hang off of the decoded ROM code that's about to go away
+	if (cpu != nullptr)
+		cpu->jit.Flush();
+
+	romCode.clear();
+	romCode.resize((r.data.size() + 0xFF) >> 8);
+	MapPages();
 }
 
-bool Bus::Tick()
+void Bus::MapPages()
 {
-	// Increase internal counter (used for the divider/timer register)
-	internalCounter++;
+	readPages.fill(nullptr);
+	writePages.fill(nullptr);
 
-	// Tick the CPU forward one cycle if it isn't stopped
-	if(!cpu->stopped)
-		cpu->Tick();
+	// WRAM and ECHO RAM. The rest of FExx is OAM and garbage, so that one stays slow
+	for (WORD page = 0xC0; page < 0xFE; page++)
+	{
+		readPages[page] = wram.data() + ((page << 8) & 0x1FFF);
+		writePages[page] = readPages[page];
+	}
 
-	// LCD and CPU operate on the same clock (I think they do at least,
-	// the gbdev wiki is incredibly inconsistent about the use of the terms
-	// "cycles", "dots" and "clocks" so I just took a guess
-	lcd->Tick();
+	// The cartridge knows best where its banks are
+	if (rom != nullptr)
+		rom->MapPages(readPages, writePages);
 
-	// The divider registers increases everytime the internal counter counts to 255
-	if (!(internalCounter % 0xFF))
-		div++;
+	// Code has to know about writes to the RAM it's in
+	for (WORD page = 0xC0; page < 0xFE; page++)
+	{
+		if (ramCode[page & 0x1F] != nullptr)
+			writePages[page] = nullptr;
+	}
+
+	codePages.fill(nullptr);
+}
+
+void Bus::MapROMPages()
+{
+	rom->MapPages(readPages, writePages);
+	std::fill(codePages.begin(), codePages.begin() + 0x80, nullptr);
+}
 
-	// If the timer is enabled and the internal counter hit some number we do some stuff
-	if (tac.w.enable && !(internalCounter % timerModuloLookup[tac.w.select]))
+CodePage* Bus::MapCode(WORD addr)
+{
+	BYTE page = addr >> 8;
+	std::unique_ptr<CodePage>* code = nullptr;
+
+	if (page == 0x00 && dmg_rom == 0)
 	{
-		// Like increase the timer register
-		tima++;
-		if (tima == 0x00)
-		{
-			// if the timer overflows set it to tma and issue an interrupt
-			tima = tma;
-			cpu->interruptFlag.flags.timer = 1;
-		}
+		code = &biosCode;
 	}
+	else if (page < 0x80)
+	{
+		// Only if it's actually in the cartridge
+		const BYTE* mapped = readPages[page];
+		if (rom == nullptr || mapped < rom->data.data() || mapped >= rom->data.data() + rom->data.size())
+			return nullptr;
 
-	return true;
+		code = &romCode[(mapped - rom->data.data()) >> 8];
+	}
+	else if (page >= 0xC0 && page < 0xFE)
+	{
+		// Don't forget about the echo
+		code = &ramCode[page & 0x1F];
+		writePages[0xC0 | (page & 0x1F)] = nullptr;
+		if ((page & 0x1F) < 0x1E)
+			writePages[0xE0 | (page & 0x1F)] = nullptr;
+	}
+	else if (page == 0xFF)		// The OAM DMA routine lives here. Tick() makes sure nothing from I/O gets cached
+	{
+		code = &ramCode[0x20];
+	}
+	else						// VRAM, cartridge RAM, OAM. Nobody does that (hopefully)
+	{
+		return nullptr;
+	}
+
+	if (*code == nullptr)
+		*code = std::make_unique<CodePage>();
+
+	codePages[page] = code->get();
+	return codePages[page];
+}
+
+void Bus::InvalidateCode(WORD addr)
+{
+	CodePage* code = (addr >= 0xFF00) ? ramCode[0x20].get() : ramCode[(addr >> 8) & 0x1F].get();
+	if (code == nullptr)
+		return;
+
+	// Instructions are at most 3 bytes long and never cross a page, so only the
+	// ones that start at most 2 bytes earlier in the same page could contain this one
+	BYTE offset = addr & 0xFF;
+	for (BYTE back = 0; back < 3 && back <= offset; back++)
+	{
+		DecodedInstruction& instruction = (*code)[offset - back];
+		if (instruction.length > back)
+			instruction.length = 0;
+	}
+}
+
+bool Bus::Tick()
+{
+	return RunUntil(internalCounter + 1);
 }
 
 bool Bus::Execute()
@@ -92,30 +179,387 @@ bool Bus::Execute()
 			return false;
 	}
 
-	Tick();
-	return true;
+	return Tick();
 }
 
 bool Bus::Frame()
 {
-	// Just tick for one frame
+	// The LCD resets its cycle counter when it wraps back around to the first
+	// scanline, so figure out how far away that is and run until then (plus one)
 	while (lcd->cycles > 0)
 	{
-		Tick();
+		QWORD lines = (lcd->ly < 153) ? (153 - lcd->ly) : 0;
+		if (!RunUntil(internalCounter + lines * 456 + (456 - lcd->scanlineCycles)))
+			return false;
+	}
+
+	return Tick();
+}
+
+bool Bus::RunUntil(QWORD cycle)
+{
+	// The host might have changed the joypad or something in between calls
+	lastEvent = internalCounter;
+
+	while (internalCounter < cycle)
+	{
+		// The CPU doesn't tick at all while it's stopped, only the host can wake it up again
+		if (cpu->stopped)
+		{
+			Advance(cycle);
+			break;
+		}
+
+		// If halted, then we have to pray to the gods an interrupt occurs to free us from this cursed existence
+		if (cpu->halted)
+		{
+			if (cpu->interruptEnable.b & cpu->interruptFlag.b)
+			{
+				cpu->halted = false;
+			}
+			else
+			{
+				// Interrupt flags only ever get set by scheduled events (or the host in between
+				// frames), so we can skip straight to the next one and check again
+				Advance(HaltWakeup(cycle));
+				continue;
+			}
+		}
+
+		// The CPU is still busy with its last instruction for a few cycles, after that it
+		// executes the next one. Until then there's no point in bothering it
+		QWORD next = internalCounter + cpu->cycles + 1;
+		if (next > cycle)
+		{
+			cpu->totalCycles += cycle - internalCounter;
+			cpu->cycles -= (BYTE)(cycle - internalCounter);
+			Advance(cycle);
+			break;
+		}
+
+		cpu->totalCycles += cpu->cycles;
+		cpu->cycles = 0;
+		Advance(next - 1);
+
+		// If an interrupt is about to be serviced, its flag is going to be cleared. The LCD
+		// needs to be up to date for that, otherwise it could set it again after the fact
+		bool interrupt = cpu->ime && (cpu->interruptEnable.b & cpu->interruptFlag.b);
+		if (interrupt)
+			lcd->RunUntil(internalCounter);
+
+		// The CPU sees the world as it was at the end of the previous cycle, then
+		// the devices get to do their thing for this one. If the JIT has a block for
+		// this, it might get a few more instructions done before anyone else has to
+		QWORD ran = 0;
+		if (interrupt || !cpu->jit.Run(cycle, ran))
+			cpu->Tick();
+		if (interrupt)
+			ScheduleLCD();
+		next += ran;
+
+		// If the CPU is stuck in an idle loop, skip as many iterations as we can
+		if (cpu->idlePeriod)
+			next += SkipIdleLoop(cycle);
+
+		// Or copying memory around, then do that in one go
+		if (cpu->bulkLoop.period)
+			next += RunBulkLoop(cycle);
+
+		Advance(next);
+
 		if (invalid)
 			return false;
 	}
 
-	Tick();
+	// Whoever called us probably wants to look at the screen
+	lcd->RunUntil(internalCounter);
 	return true;
 }
 
-BYTE Bus::Read(WORD addr)
+void Bus::Advance(QWORD cycle)
 {
+	while (internalCounter < cycle)
+	{
+		// Nothing happens until the next event. The LCD lags behind and catches up on its own
+		internalCounter = std::min(scheduler.Next(), cycle);
+
+		Event event;
+		while (scheduler.Pop(internalCounter, event))
+		{
+			HandleEvent(event);
+			if (event != Event::Profile)
+				lastEvent = internalCounter;
+		}
+	}
+}
+
+QWORD Bus::HaltWakeup(QWORD cycle)
+{
+	// Only the events that can set an enabled interrupt can wake the CPU up. The LCD
+	// is going to be caught up on everything else in one go once the CPU is awake
+	QWORD wakeup = cycle;
+	if (cpu->interruptEnable.flags.timer)
+		wakeup = std::min(wakeup, scheduler.When(Event::Timer));
+
+	if (cpu->interruptEnable.flags.vblank || cpu->interruptEnable.flags.lcd_stat)
+		wakeup = std::min(wakeup, scheduler.When(Event::LCD));
+
+	return wakeup;
+}
+
+QWORD Bus::SkipIdleLoop(QWORD cycle)
+{
+	QWORD period = cpu->idlePeriod;
+	cpu->idlePeriod = 0;
+
+	// The last iteration only tells us what the next ones are going to do if nothing
+	// changed while it was running
+	QWORD start = internalCounter - period;
+	if (lastEvent > start)
+		return 0;
+
+	if ((idleReads & IDLE_READ_LCD) && lcd->lastModeChange > start)
+		return 0;
+
+	// Whatever the loop polls can only change once the next event happens. Or once the
+	// LCD changes its mode, if the loop looks at the LCD
+	QWORD until = std::min(scheduler.Next(), cycle);
+	if (idleReads & IDLE_READ_LCD)
+		until = std::min(until, lcd->NextModeChange());
+
+	// Only skip whole iterations that are done before anything changes, so that
+	// the CPU ends up in the exact same state it would have otherwise
+	if (until <= internalCounter + 1)
+		return 0;
+
+	QWORD skipped = (until - 1 - internalCounter) / period * period;
+	cpu->totalCycles += skipped;
+	cpu->idleLoop.cycle += skipped;
+	cpu->idleStats.skippedCycles += skipped;
+
+	return skipped;
+}
+
+QWORD Bus::RunBulkLoop(QWORD cycle)
+{
+	BulkLoop& loop = cpu->bulkLoop;
+	QWORD period = loop.period;
+	loop.period = 0;
+
+	// If an interrupt comes next, the loop doesn't
+	if (cpu->ime && (cpu->interruptEnable.b & cpu->interruptFlag.b))
+		return 0;
+
+	// Same as with idle loops, all of it has to be done before anything else happens. Then nobody
+	// can tell when exactly the bytes were copied, only in which order. The CPU does the last
+	// iteration itself so it falls out of the loop the normal way
+	BYTE& b = cpu->BC.b.hi;
+	BYTE& c = cpu->BC.b.lo;
+	DWORD remaining = (loop.counter == BULK_COUNTER_BC) ? cpu->BC.w : ((loop.counter == BULK_COUNTER_B) ? b : c);
+	QWORD until = std::min(scheduler.Next(), cycle);
+	if (remaining < 2 || until <= internalCounter + 1)
+		return 0;
+
+	QWORD count = std::min<QWORD>(remaining - 1, (until - 1 - internalCounter) / period);
+
+	// Stop at the first iteration that would touch anything but plain memory, or the loop itself
+	bool copy = (loop.source == BULK_FROM_HL || loop.source == BULK_FROM_DE);
+	WORD from = (loop.source == BULK_FROM_HL) ? cpu->HL.w : cpu->DE.w;
+	WORD to = (loop.source == BULK_FROM_HL) ? cpu->DE.w : cpu->HL.w;
+	int step = (loop.source == BULK_FROM_HL) ? 1 : loop.hlStep;
+	bool checkedLCD = false;
+
+	// The loop could also be overwriting itself through the echo. If it runs right across $E000 the
+	// range wraps, then anything that isn't in the middle of it counts
+	WORD loopStart = UnmirrorWRAM(loop.start);
+	WORD loopEnd = UnmirrorWRAM(loop.end);
+
+	QWORD done = 0;
+	for (; done < count; done++)
+	{
+		WORD src = from + (WORD)done;
+		WORD dst = to + (WORD)(done * step);
+		WORD at = UnmirrorWRAM(dst);
+		if ((loopStart <= loopEnd) ? (at >= loopStart && at <= loopEnd) : (at >= loopStart || at <= loopEnd))
+			break;
+
+		bool vramSrc = copy && src >= 0x8000 && src < 0xA000;
+		bool vramDst = dst >= 0x8000 && dst < 0xA000;
+		if ((vramSrc || vramDst) && !checkedLCD)
+		{
+			// VRAM is only plain memory while the LCD isn't drawing, and it has to stay that way
+			lcd->RunUntil(internalCounter);
+			if (lcd->stat.w.mode == 3)
+				break;
+
+			count = std::min(count, (lcd->NextModeChange() - 1 - internalCounter) / period);
+			checkedLCD = true;
+			if (done >= count)
+				break;
+		}
+
+		if ((!vramDst && !IsPlainMemory(dst, true)) || (copy && !vramSrc && !IsPlainMemory(src, false)))
+			break;
+	}
+
+	if (done == 0)
+		return 0;
+
+	BYTE val = (loop.source == BULK_ZERO) ? 0x00 : cpu->AF.b.hi;
+	for (QWORD i = 0; i < done; i++)
+	{
+		if (copy)
+			val = Read(from++);
+
+		Write(to, val);
+		to += step;
+	}
+
+	// Leave the registers like the last iteration would have
+	if (loop.source == BULK_FROM_HL)
+	{
+		cpu->HL.w = from;
+		cpu->DE.w = to;
+	}
+	else
+	{
+		cpu->DE.w += copy ? (WORD)done : 0;
+		cpu->HL.w = to;
+	}
+
+	cpu->AF.b.hi = val;
+	cpu->SyncFlags();
+	if (loop.counter == BULK_COUNTER_BC)
+	{
+		cpu->BC.w -= (WORD)done;
+		cpu->AF.b.hi = b | c;
+		cpu->flag->f.zero = 0;		// OR C, and the result can't be zero or we'd be out of the loop
+		cpu->flag->f.negative = 0;
+		cpu->flag->f.halfCarry = 0;
+		cpu->flag->f.carry = 0;
+	}
+	else
+	{
+		BYTE& r = (loop.counter == BULK_COUNTER_B) ? b : c;
+		r -= (BYTE)done;
+		cpu->flag->f.zero = 0;
+		cpu->flag->f.negative = 1;
+		cpu->flag->f.halfCarry = ((r & 0x0F) == 0x0F);
+		if (loop.source == BULK_ZERO)
+			cpu->flag->f.carry = 0;		// XOR A cleared it, DEC doesn't touch it
+	}
+
+	QWORD skipped = done * period;
+	cpu->totalCycles += skipped;
+	cpu->idleLoop.cycle += skipped;
+	cpu->idleStats.bulkLoops++;
+	cpu->idleStats.bulkCycles += skipped;
+
+	return skipped;
+}
+
+void Bus::HandleEvent(Event event)
+{
+	switch (event)
+	{
+	case Event::Timer:
+		// The timer overflowed, so it's set to tma and issues an interrupt
+		tima = tma;
+		timaSince = internalCounter;
+		cpu->interruptFlag.flags.timer = 1;
+
+		ScheduleTimer();
+		break;
+
+	case Event::LCD:
+		lcd->RunUntil(internalCounter);
+		ScheduleLCD();
+		break;
+
+	case Event::Profile:
+		cpu->profiler->Sample();
+		scheduler.Schedule(Event::Profile, internalCounter + cpu->profiler->interval);
+		break;
+
+	default:
+		break;
+	}
+}
+
+void Bus::ScheduleLCD()
+{
+	scheduler.Schedule(Event::LCD, lcd->NextEvent());
+}
+
+void Bus::ScheduleTimer()
+{
+	// If the timer is enabled it ticks whenever the internal counter hits some multiple of some
+	// number, so we know exactly when it's going to overflow
+	if (tac.w.enable)
+	{
+		WORD period = timerModuloLookup[tac.w.select];
+		scheduler.Schedule(Event::Timer, (timaSince / period + (0x100 - tima)) * period);
+	}
+	else
+	{
+		scheduler.Cancel(Event::Timer);
+	}
+}
+
+BYTE Bus::GetDIV()
+{
+	// The divider registers increases everytime the internal counter counts to 255
+	return div + (BYTE)(internalCounter / 0xFF - divSince / 0xFF);
+}
+
+BYTE Bus::GetTIMA()
+{
+	if (!tac.w.enable)
+		return tima;
+
+	WORD period = timerModuloLookup[tac.w.select];
+	QWORD increments = internalCounter / period - timaSince / period;
+	if (increments < (QWORD)0x100 - tima)
+		return tima + (BYTE)increments;
+
+	// If it overflowed in the meantime it continues counting up from tma
+	increments -= 0x100 - tima;
+	return tma + (BYTE)(increments % (0x100 - tma));
+}
+
+void Bus::SyncTimer()
+{
+	tima = GetTIMA();
+	timaSince = internalCounter;
+}
+
+void Bus::WriteTimer(WORD addr, BYTE val)
+{
+	// Everything that happened with the old settings needs to be stored before they change
+	SyncTimer();
+
+	switch (addr)
+	{
+	case 0xFF04:	div = val;	divSince = internalCounter;		return;
+	case 0xFF05:	tima = val;		break;
+	case 0xFF06:	tma = val;		break;
+	case 0xFF07:	tac.b = val;	break;
+	}
+
+	// Any of these could move the next overflow
+	ScheduleTimer();
+}
+
+BYTE Bus::ReadSlow(WORD addr)
+{
+	if (addr >= 0xFF80 && addr < 0xFFFF)	// HRAM is by far the most common thing that ends up here
+		return hram[addr & 0x7F];
+
 	// Read from bus
 	BYTE returnVal;
 	if (lcd->Read(addr, returnVal))		// If the address is in the LCD realm, then the PPU will handle it
 	{
+		idleReads |= IDLE_READ_LCD;
 		return returnVal;
 	}
 
@@ -143,6 +587,18 @@ BYTE Bus::Read(WORD addr)
 		return joypadReg.b;								// That wasn't a joke, go read about register 0xFF00 in the gameboy
 	}
 
+	if (addr == 0xFF04)
+	{
+		idleReads |= IDLE_READ_TIMER;
+		return GetDIV();
+	}
+
+	if (addr == 0xFF05)
+	{
+		idleReads |= IDLE_READ_TIMER;
+		return GetTIMA();
+	}
+
 	return GetReference(addr);			// If none of the devices above care about the address, then the bus handles it
 }
 
@@ -151,19 +607,56 @@ BYTE Bus::Fetch(WORD addr)
 	return Read(addr);		// told ya it's literally just Read() lol
 }
 
-void Bus::Write(WORD addr, BYTE val)
+void Bus::WriteSlow(WORD addr, BYTE val)
 {
+	if (addr >= 0xFF80 && addr < 0xFFFF)
+	{
+		hram[addr & 0x7F] = val;
+		InvalidateCode(addr);
+		return;
+	}
+
+	if (addr >= 0xC000 && addr < 0xFE00)	// WRAM only ends up here if there's code in that page
+	{
+		wram[addr & 0x1FFF] = val;
+		InvalidateCode(addr);
+		return;
+	}
+
 	if (lcd->Write(addr, val))		// If the address is in the LCD realm, then the PPU will handle it
+	{
+		if (addr >= 0xFF00)			// Changing the LCD registers could change when the next interrupt happens
+			ScheduleLCD();
+
 		return;
+	}
+
+	if (0xFF04 <= addr && addr < 0xFF08)	// The timer needs some extra care
+	{
+		WriteTimer(addr, val);
+		return;
+	}
+
+	if (addr == 0xFF0F)				// Same thing if someone fiddles with the interrupt flags
+		lcd->RunUntil(internalCounter);
 
 	if ((addr >= 0x0000 && addr < 0x8000) || (addr >= 0xA000 && addr < 0xC000))		// If it is in ROM space, the ROM will handle it
 	{
 		rom->Write(addr, val);
+		if (addr < 0x8000)			// That was an MBC register, so the banks might have moved
+			MapROMPages();
+
 		return;
 	}
 
 	GetReference(addr) = val;		// otherwise the bus will handle it
 	undefined = 0xFF;
+
+	if (addr == 0xFF50)				// Boot ROM (un)mapped
+		MapROMPages();
+
+	if (addr == 0xFF0F)
+		ScheduleLCD();
 }
 
 BYTE& Bus::GetReference(WORD addr)
@@ -181,8 +674,6 @@ BYTE& Bus::GetReference(WORD addr)
 		switch (addr)
 		{
 		case 0xFF00:	return joypadReg.b;
-		case 0xFF04:	return div;
-		case 0xFF05:	return tima;
 		case 0xFF06:	return tma;
 		case 0xFF07:	return tac.b;
 		case 0xFF0F:	return cpu->interruptFlag.b;
@@ -1,11 +1,18 @@
 #pragma once
 
 #include <array>
+#include <memory>
+#include <vector>
 
 #include "util.hpp"
 #include "cpu.hpp"
 #include "lcd.hpp"
 #include "rom.hpp"
+#include "scheduler.hpp"
+
+// Reads that idle loops care about
+#define IDLE_READ_LCD	0x01
+#define IDLE_READ_TIMER	0x02
 
 // Why is this typedef? Lol
 // This was originally a C project believe it or not. I thought getting
@@ -63,15 +70,38 @@ public:
 	bool Tick();		// Execute ONE machine cycle (why would you do that lol)
 	bool Execute();		// Execute ONE CPU instruction (better but still why)
 	bool Frame();		// Execute CPU instructions until we rendered one full frame (there we go)
+	bool RunUntil(QWORD cycle);		// Execute until internalCounter reaches the given cycle. This is what all of the above use
 
-	BYTE Read(WORD addr);				// Read from the bus
-	void Write(WORD addr, BYTE val);	// Write to the bus
+	inline BYTE Read(WORD addr);			// Read from the bus
+	inline void Write(WORD addr, BYTE val);	// Write to the bus
 	BYTE Fetch(WORD addr);				// This is literally the same as Read(). Like literally. the. exact. same. 
 										// But I use it a lot in the CPU class so I'm too lazy/afraid to remove it
 
+	void MapPages();					// Rebuild the page tables. Call this whenever something moves around in memory
+	CodePage* MapCode(WORD addr);		// Find the decoded instructions for the page addr is in. nullptr if that page can't be cached
+	inline bool IsPlainMemory(WORD addr, bool write) const;	// Whether nobody would notice an access there (or when it happened)
+	inline WORD ROMBank() const;		// Which bank is in $4000-$7FFF right now
+
 private:
+	BYTE ReadSlow(WORD addr);			// Everything the page tables don't cover
+	void WriteSlow(WORD addr, BYTE val);
+	void MapROMPages();					// Banks switched, so the ROM pages (and the code in them) moved
+	void InvalidateCode(WORD addr);		// Someone wrote to RAM that might have code in it
 	BYTE& GetReference(WORD addr);		// Leftovers of a really really really bad idea, but again it's used in a few places so I'm too scared to remove it
 
+	void Advance(QWORD cycle);			// Bring all the devices forward to the given cycle
+	QWORD HaltWakeup(QWORD cycle);		// Earliest cycle (up to the given one) that could wake up a halted CPU
+	QWORD SkipIdleLoop(QWORD cycle);	// Figure out how many cycles of an idle loop can be skipped
+	QWORD RunBulkLoop(QWORD cycle);		// Do as much of a copy/fill loop as we can at once, returns the cycles that took
+	void HandleEvent(Event event);
+	void ScheduleTimer();
+
+	BYTE GetDIV();						// DIV and TIMA don't get updated every cycle, instead
+	BYTE GetTIMA();						// they're calculated from the master clock when someone reads them
+	void SyncTimer();					// Store TIMA as of right now
+	void WriteTimer(WORD addr, BYTE val);
+	void ScheduleLCD();
+
 public:
 	// Connected devices
 	ROM* rom;
@@ -86,10 +116,77 @@ public:
 	BYTE dmg_rom;
 	JoypadReg joypadReg;
 	TimerControl tac;
-	size_t internalCounter = 0;
+	BYTE undefined = 0xFF;			// What you get when you read something that isn't there
+	QWORD internalCounter = 0;		// Number of cycles the devices have been run for. This is the master clock
+	QWORD divSince = 0;				// Cycles at which div and tima held the values that are stored above
+	QWORD timaSince = 0;
+
+	Scheduler scheduler;
+
+	QWORD writes = 0;				// Number of writes so far, and what kind of I/O reads there were
+	BYTE idleReads = 0;				// since the CPU started watching a loop
+	QWORD lastEvent = 0;			// Cycle at which anything outside of the CPU last happened
 
 	Joypad joypad;
 
 	std::array<BYTE, 0x2000> wram;
 	std::array<BYTE, 0x80> hram;		// <-- This should be in the CPU class but who cares
-};
\ No newline at end of file
+
+	// One host pointer for every 256 byte page of the address space. If there is one, reading/writing
+	// that page is just plain memory. If it's nullptr someone needs to know about the access (I/O, VRAM,
+	// MBC registers, ...) and we go the slow way
+	std::array<BYTE*, 0x100> readPages;
+	std::array<BYTE*, 0x100> writePages;
+
+	// Same idea for code. The decoded instructions are keyed by where they are in the ROM (so by bank
+	// and address) or RAM, and codePages says which ones are mapped where right now. nullptr means
+	// that hasn't been looked up since the last bank switch, or that the page can't be cached.
+	// RAM pages with code in them lose their writePages entry so that writes can invalidate it
+	std::array<CodePage*, 0x100> codePages;
+	std::vector<std::unique_ptr<CodePage>> romCode;		// One per 256 bytes of ROM, made the first time something runs there
+	std::array<std::unique_ptr<CodePage>, 0x21> ramCode;	// WRAM pages, then HRAM
+	std::unique_ptr<CodePage> biosCode;
+};
+
+inline BYTE Bus::Read(WORD addr)
+{
+	const BYTE* page = readPages[addr >> 8];
+	if (page != nullptr)
+		return page[addr & 0xFF];
+
+	return ReadSlow(addr);
+}
+
+inline bool Bus::IsPlainMemory(WORD addr, bool write) const
+{
+	// WRAM always is, even if code in there needs invalidating. HRAM too, minus IE
+	if ((addr >= 0xC000 && addr < 0xFE00) || (addr >= 0xFF80 && addr < 0xFFFF))
+		return true;
+
+	return (write ? writePages : readPages)[addr >> 8] != nullptr;
+}
+
+inline WORD Bus::ROMBank() const
+{
+	// Whatever the MBC did, the page table knows where that part of the ROM ended up
+	const std::vector<BYTE>& data = rom->Data();
+	const BYTE* page = readPages[0x40];
+	if (page < data.data() || page >= data.data() + data.size())
+		return 0;
+
+	return (WORD)((page - data.data()) / 0x4000);
+}
+
+inline void Bus::Write(WORD addr, BYTE val)
+{
+	writes++;
+
+	BYTE* page = writePages[addr >> 8];
+	if (page != nullptr)
+	{
+		page[addr & 0xFF] = val;
+		return;
+	}
+
+	WriteSlow(addr, val);
+}
\ No newline at end of file
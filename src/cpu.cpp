@@ -1,10 +1,13 @@
 #include "bus.hpp"
 
 #include <assert.h>
+#include <string.h>
 #include <string>
 
+// Printing every instruction made debug builds crawl even with disablePrint set, so that's
+// opt-in now (define TEXT_LOG). The trace (see trace.hpp) is a lot cheaper
 #ifndef NDEBUG
-	#ifndef NO_LOG
+	#ifdef TEXT_LOG
 		#define DBG_MSG(fmt, ...) if(!disablePrint) printf(fmt, ##__VA_ARGS__)
 	#else
 		#define DBG_MSG(fmt, ...) do {} while(0)
@@ -33,9 +36,9 @@
 #define XZ_ID(op)	(op.xyz.x * 8 + op.xyz.z)		// what?
 
 #ifndef NDEBUG
-	#ifndef NO_LOG
+	#ifdef TEXT_LOG
 static const char* operandNames[8] = { "B", "C", "D", "E", "H", "L", "(HL)", "A" };
-static int disablePrint = 1;
+static const char* cbOperationNames[11] = { "RLC", "RRC", "RL", "RR", "SLA", "SRA", "SWAP", "SRL", "BIT", "RES", "SET" };
 	#endif
 #endif
 
@@ -45,14 +48,12 @@ void CPU::Powerup()
 {
 	// Some basic setup (Is this even necessary?)
 	ime = 0;
+	disablePrint = true;
 	flag = (StatusFlag*)(&(AF.b.lo));
+	lazyFlags.op = FLAGS_SYNCED;
 
 	PC.w = 0x0000;
 
-	// Setup opcode decoding lookups
-	rp = { &BC, &DE, &HL, &SP };
-	rp2 = { &BC, &DE, &HL, &AF };
-
 #ifndef NDEBUG
 	// Setup register names
 	SETUP_REGISTER(AF);
@@ -68,30 +69,30 @@ void CPU::Powerup()
 	// Reset cycles
 	cycles = 0;
 	totalCycles = 0;
+	instructions = 0;
 
 	stopped = false;
 	halted = false;
 	justHaltedWithDI = false;
+
+	idleLoopDetection = true;
+	idlePeriod = 0;
+	idleLoop.branch = 0xFFFF;
+	idleStats.hits = 0;
+	idleStats.skippedCycles = 0;
+	idleStats.bulkLoops = 0;
+	idleStats.bulkCycles = 0;
+	idleStats.loops.clear();
+	bulkLoop.period = 0;
+
+	jit.Reset(*this);
 }
 
 void CPU::Tick()
 {
-	// If halted, then we have to pray to the gods an interrupt occurs to free us from this cursed existence
-	if (halted)
-	{
-		if (interruptEnable.b & interruptFlag.b)
-			halted = false;
-		else
-			return;
-	}
-
-	// If we still have cycles left, then come back later and try again
+	// The bus only calls this once we're done with the previous instruction (and
+	// not halted), so there's always something to do here
 	totalCycles++;
-	if (cycles != 0)
-	{
-		cycles--;
-		return;
-	}
 
 	// Check for interrupts
 	if (ime)
@@ -107,6 +108,12 @@ void CPU::Tick()
 
 		if (interruptMask)
 		{
+			if (trace != nullptr)
+			{
+				BYTE type[3] = { (BYTE)interruptType, 0, 0 };
+				Record(TRACE_INTERRUPT, type);
+			}
+
 			// reset interrupt flag
 			interruptFlag.b &= ~(0x1 << interruptType);
 			ime = 0;
@@ -115,6 +122,8 @@ void CPU::Tick()
 			PUSH(PC.b.hi);
 			PUSH(PC.b.lo);
 			PC.w = interruptVectors[interruptType];
+			if (profiler != nullptr)
+				profiler->Call(PC.w, SP.w);
 
 			// Will take 24 machine cycles
 			cycles = 24;
@@ -123,225 +132,378 @@ void CPU::Tick()
 	}
 
 #ifndef NDEBUG
-	#ifndef NO_LOG
+	#ifdef TEXT_LOG
 	// if (PC.w == 0x0100) disablePrint = 0;
 	// disablePrint = 0;
-	#endif 
+	#endif
 #endif
 
-	// Fetch
+	// Fetch & decode. Code in ROM and RAM was most likely decoded before, so it's just a lookup
 	DBG_MSG("[%10zu] $%04x\t", totalCycles, PC.w);
-	opcode.b = bus->Fetch(PC.w++);
-	cycles = 4;
+	opcodeAddress = PC.w;
 
-	if (justHaltedWithDI)
+	const DecodedInstruction* instruction;
+	CodePage* code = bus->codePages[PC.w >> 8];
+	if (code != nullptr && (*code)[PC.w & 0xFF].length != 0 && !justHaltedWithDI)
+		instruction = &(*code)[PC.w & 0xFF];
+	else
+		instruction = FetchSlow();
+
+	// Don't make PC depend on anything that was just loaded from the cache. Every instruction would have
+	// to wait for the previous one's lookup otherwise, which made this slower than not having a cache at all
+	PC.w++;
+	opcode.b = instruction->bytes[0];
+	nextOperand = instruction->bytes + 1;
+	cycles = instruction->cycles;
+
+	// Execute. Every opcode has its own handler, see Instruction() below
+	if (trace != nullptr)
+		Record(TRACE_INSTRUCTION, instruction->bytes);
+
+	instructions++;
+#ifdef OPCODE_STATS
+	WORD counted = (opcode.b == 0xCB) ? (0x100 | instruction->bytes[1]) : opcode.b;
+	instruction->handler(*this);
+	opcodeStats.Count(counted, cycles);
+#else
+	instruction->handler(*this);
+#endif
+
+#if !defined(NDEBUG) && defined(TEXT_LOG)
+	SyncFlags();
+#endif
+	DBG_MSG("\t\t AF: %04x  BC: %04x  DE: %04x  HL: %04x  SP: %04x  F: %u%u%u%u", AF.w, BC.w, DE.w, HL.w, SP.w, flag->f.zero, flag->f.negative, flag->f.halfCarry, flag->f.carry);
+	DBG_MSG("\t (LY: %03u  SC: %03u  FC: %05u)\n", bus->lcd->ly, bus->lcd->scanlineCycles, bus->lcd->cycles);
+}
+
+void CPU::Record(BYTE kind, const BYTE* bytes)
+{
+	SyncFlags();
+
+	TraceEntry& entry = trace->Next();
+	entry.cycle = bus->internalCounter;
+	entry.pc = PC.w;
+	entry.af = AF.w;
+	entry.bc = BC.w;
+	entry.de = DE.w;
+	entry.hl = HL.w;
+	entry.sp = SP.w;
+	entry.bank = bus->ROMBank();
+	entry.kind = kind;
+	memcpy(entry.bytes, bytes, sizeof(entry.bytes));
+}
+
+// One handler per opcode, all generated from Instruction<op>() at compile time. The tables hold plain
+// function pointers that forward to the member functions, because calling through a member function
+// pointer turned out to be almost twice as slow as the giant switch this replaced
+template<void (CPU::*handler)()>
+void CPU::Forward(CPU& cpu)
+{
+	(cpu.*handler)();
+}
+
+// CB prefixed opcodes are split up into operation, bit and register. (HL) gets its own
+// version because that's the only one that has to go through the bus
+template<BYTE op>
+constexpr CPU::Handler CPU::CBHandler()
+{
+	constexpr BYTE x = op >> 6;
+	constexpr BYTE y = (op >> 3) & 0x7;
+	constexpr BYTE z = op & 0x7;
+
+	constexpr CBOp operation = (x == 0) ? (CBOp)y : (CBOp)((BYTE)CBOp::BIT + x - 1);
+	constexpr BYTE bit = (x == 0) ? 0 : y;
+
+	if constexpr (z == 6)
+		return &Forward<&CPU::CBMemory<operation, bit>>;
+	else
+		return &Forward<&CPU::CBRegister<operation, bit, z>>;
+}
+
+template<size_t... op>
+constexpr std::array<CPU::Handler, sizeof...(op)> CPU::MakeHandlers(std::index_sequence<op...>)
+{
+	return { &Forward<&CPU::Instruction<op>>... };
+}
+
+template<size_t... op>
+constexpr std::array<CPU::Handler, sizeof...(op)> CPU::MakeCBHandlers(std::index_sequence<op...>)
+{
+	return { CBHandler<op>()... };
+}
+
+const std::array<CPU::Handler, 0x100> CPU::handlers = CPU::MakeHandlers(std::make_index_sequence<0x100>());
+const std::array<CPU::Handler, 0x100> CPU::cbHandlers = CPU::MakeCBHandlers(std::make_index_sequence<0x100>());
+
+// How many bytes every opcode takes up, including the immediates. Has to match what the handlers read with Immediate()
+constexpr BYTE CPU::InstructionLength(BYTE op)
+{
+	BYTE x = op >> 6;
+	BYTE y = (op >> 3) & 0x7;
+	BYTE z = op & 0x7;
+	BYTE q = y & 0x1;
+
+	if (x == 1 || x == 2)
+		return 1;
+
+	if (x == 0)
 	{
-		PC.w--;
-		justHaltedWithDI = false;
+		if (z == 0)	return (y == 1) ? 3 : (y >= 3) ? 2 : 1;		// LD (nn), SP / JR / NOP and STOP
+		if (z == 1)	return (q == 0) ? 3 : 1;					// LD rr, nn / ADD HL, rr
+		if (z == 6)	return 2;									// LD r, n
+		return 1;
 	}
 
-	/*
-		In the following switch statement the given opcode is decoded
-		according to this:
-		https://gb-archive.github.io/salvage/decoding_gbz80_opcodes/Decoding%20Gamboy%20Z80%20Opcodes.html
-		It might look ugly but it's gonna make debugging a lot easier I hope
-	*/
+	switch (z)
+	{
+	case 0:	return (y >= 4) ? 2 : 1;						// LDH and SP stuff / RET cc
+	case 2:	return (y < 4 || y == 5 || y == 7) ? 3 : 1;		// JP cc, LD (nn), A, LD A, (nn) / LD (C), A
+	case 3:	return (y == 0) ? 3 : (y == 1) ? 2 : 1;			// JP nn, CB prefix
+	case 4:	return (y < 4) ? 3 : 1;							// CALL cc
+	case 5:	return (op == 0xCD) ? 3 : 1;					// CALL nn
+	case 6:	return 2;										// ALU n
+	}
 
-	switch (opcode.xyz.x)
+	return 1;
+}
+
+template<size_t... op>
+constexpr std::array<BYTE, sizeof...(op)> CPU::MakeInstructionLengths(std::index_sequence<op...>)
+{
+	return { InstructionLength(op)... };
+}
+
+const std::array<BYTE, 0x100> CPU::instructionLengths = CPU::MakeInstructionLengths(std::make_index_sequence<0x100>());
+
+// Reads the instruction at addr and figures out which handler it needs. The immediates are usually right
+// after the opcode, except when the HALT bug strikes
+void CPU::Decode(DecodedInstruction& instruction, WORD addr, WORD operandAddr)
+{
+	instruction.bytes[0] = bus->Read(addr);
+	instruction.heat = 0;
+	instruction.block = 0;
+	instruction.length = instructionLengths[instruction.bytes[0]];
+	for (BYTE i = 1; i < instruction.length; i++)
+		instruction.bytes[i] = bus->Read(operandAddr + i - 1);
+
+	if (instruction.bytes[0] == 0xCB)
 	{
-		/////////////// X = 0 ///////////////
-	case 0:
+		// Skip the CB handler and go straight to the one that does the work
+		instruction.handler = cbHandlers[instruction.bytes[1]];
+		instruction.cycles = 12;
+	}
+	else
 	{
-		switch (opcode.xyz.z)
-		{
-			/////////////// RELATIVE JUMPS & ASSORTED OPS ///////////////
-		case 0:
+		instruction.handler = handlers[instruction.bytes[0]];
+		instruction.cycles = 4;
+	}
+}
+
+// Everything that isn't in the cache yet (or can't be)
+const DecodedInstruction* CPU::FetchSlow()
+{
+	WORD operandAddr = PC.w + 1;
+	if (justHaltedWithDI)
+	{
+		operandAddr--;				// The byte after the HALT gets read twice, so this one can't come from the cache
+		justHaltedWithDI = false;
+	}
+	else
+	{
+		CodePage* code = bus->codePages[PC.w >> 8];
+		if (code == nullptr)
+			code = bus->MapCode(PC.w);
+
+		if (code != nullptr && (PC.w < 0xFF00 || PC.w >= 0xFF80))
 		{
-			bool condition = true;
-			char offset = 0x00;
+			// Instructions that reach into the next page (or into IE) could change without us noticing, those don't get cached
+			BYTE length = instructionLengths[bus->Read(PC.w)];
+			if ((PC.w & 0xFF) + length <= 0x100 && PC.w + length <= 0xFFFF)
+			{
+				// The page might just not have been looked up again since the last bank switch. Then what's in
+				// there is still good, and decoding it again would throw away the block that starts there
+				DecodedInstruction& cached = (*code)[PC.w & 0xFF];
+				if (cached.length == 0)
+					Decode(cached, PC.w, operandAddr);
+
+				return &cached;
+			}
+		}
+	}
 
-			switch (opcode.xyz.y)
+	Decode(uncached, PC.w, operandAddr);
+	PC.w = operandAddr - 1;			// Tick() moves it past the opcode
+	return &uncached;
+}
+
+inline BYTE CPU::Immediate()
+{
+	PC.w++;
+	return *(nextOperand++);
+}
+
+/*
+	Opcodes are decoded according to this:
+	https://gb-archive.github.io/salvage/decoding_gbz80_opcodes/Decoding%20Gamboy%20Z80%20Opcodes.html
+	This used to be one giant switch that got walked through for every single instruction. Now
+	x, y, z, p and q are known at compile time, so every opcode gets its own function that only
+	contains the code for that one opcode
+*/
+template<BYTE op>
+void CPU::Instruction()
+{
+	constexpr BYTE x = op >> 6;
+	constexpr BYTE y = (op >> 3) & 0x7;
+	constexpr BYTE z = op & 0x7;
+	constexpr BYTE p = y >> 1;
+	constexpr BYTE q = y & 0x1;
+
+	/////////////// X = 0 ///////////////
+	if constexpr (x == 0)
+	{
+		/////////////// RELATIVE JUMPS & ASSORTED OPS ///////////////
+		if constexpr (z == 0)
+		{
+			if constexpr (y == 0)		// NOP
 			{
-			case 0:		// NOP
 				DBG_MSG("NOP\t");
-				break;
-
-			case 1:		// LD (nn), SP
+			}
+			else if constexpr (y == 1)	// LD (nn), SP
 			{
 				Register address;
-				address.b.lo = bus->Fetch(PC.w++);
-				address.b.hi = bus->Fetch(PC.w++);
+				address.b.lo = Immediate();
+				address.b.hi = Immediate();
 
 				bus->Write(address.w, SP.b.lo);
 				bus->Write(address.w + 1, SP.b.hi);
 
 				cycles += 16;
 				DBG_MSG("LD ($%04x), SP", address.w);
-				break;
 			}
-
-			case 2:		// STOP
+			else if constexpr (y == 2)	// STOP
+			{
 				stopped = true;
 				DBG_MSG("STOP");
-				break;
-
-			case 3:		// JR
-				DBG_MSG("JR ");
+			}
+			else						// JR, JR NZ, JR Z, JR NC, JR C
+			{
+				bool condition = true;
+				if constexpr (y > 3)
+					condition = Condition<y - 4>();
 
-			relative_jump:
-				offset = bus->Fetch(PC.w++);
-				DBG_MSG("$%04x", PC.w + offset);
+				char offset = Immediate();
+				DBG_MSG("JR $%04x", PC.w + offset);
 
 				PC.w += offset * condition;
 				cycles += 4 + (4 * condition);
-				break;
-
-			case 4:		// JNZ
-				condition = !flag->f.zero;
-				DBG_MSG("JR NZ, ");
-				goto relative_jump;
-
-			case 5:		// JZ
-				condition = flag->f.zero;
-				DBG_MSG("JR Z, ");
-				goto relative_jump;
-
-			case 6:		// JNC
-				condition = !flag->f.carry;
-				DBG_MSG("JR NC, ");
-				goto relative_jump;
-
-			case 7:		// JC
-				condition = flag->f.carry;
-				DBG_MSG("JR C, ");
-				goto relative_jump;
+
+				if (condition && offset < 0)
+					CheckIdleLoop(opcodeAddress);
 			}
-			break;
 		}
 
-			/////////////// 16 BIT LOAD IMMEDIATE | ADD ///////////////
-		case 1:
+		/////////////// 16 BIT LOAD IMMEDIATE | ADD ///////////////
+		else if constexpr (z == 1)
 		{
-			Register* operand = rp[opcode.pq.p];
-			switch (opcode.pq.q)
+			Register& operand = RP<p>();
+			if constexpr (q == 0)		// LD rp[p], nn
 			{
-			case 0:		// LD rp[p], nn
-				operand->b.lo = bus->Fetch(PC.w++);
-				operand->b.hi = bus->Fetch(PC.w++);
+				operand.b.lo = Immediate();
+				operand.b.hi = Immediate();
 
 				cycles += 8;
-				DBG_MSG("LD %s, $%04x", REGNAME(operand), operand->w);
-				break;
-
-			case 1:		// ADD HL, rp[p]
-				flag->f.halfCarry = ((((HL.w & 0xFFF) + (operand->w & 0xFFF)) & 0x1000) == 0x1000);
-				flag->f.carry = (0xFFFF - operand->w < HL.w);
+				DBG_MSG("LD %s, $%04x", REGNAME((&operand)), operand.w);
+			}
+			else						// ADD HL, rp[p]
+			{
+				SyncFlags();
+				flag->f.halfCarry = ((((HL.w & 0xFFF) + (operand.w & 0xFFF)) & 0x1000) == 0x1000);
+				flag->f.carry = (0xFFFF - operand.w < HL.w);
 				flag->f.negative = 0;
-				HL.w += operand->w;
+				HL.w += operand.w;
 
 				cycles += 4;
-				DBG_MSG("ADD HL, %s", REGNAME(operand));
-				break;
+				DBG_MSG("ADD HL, %s", REGNAME((&operand)));
 			}
-
-			break;
 		}
 
-			/////////////// INDIRECT LOADING ///////////////
-		case 2:
+		/////////////// INDIRECT LOADING ///////////////
+		else if constexpr (z == 2)
 		{
-			DBG_MSG("LD ");
-#ifndef NDEBUG
-			if (opcode.pq.q == 1)	DBG_MSG("A, ");
-#endif
-			WORD targetAddr = 0x0000;	// Dummy initialization
-			switch (opcode.pq.p)
-			{
-			case 0:	targetAddr = BC.w;			DBG_MSG("(BC)");	break;
-			case 1:	targetAddr = DE.w;			DBG_MSG("(DE)");	break;
-			case 2:	targetAddr = HL.w++;		DBG_MSG("(HL+)");	break;
-			case 3:	targetAddr = HL.w--;		DBG_MSG("(HL-)");	break;
-			}
+			WORD targetAddr;
+			if constexpr (p == 0)		targetAddr = BC.w;
+			else if constexpr (p == 1)	targetAddr = DE.w;
+			else if constexpr (p == 2)	targetAddr = HL.w++;
+			else						targetAddr = HL.w--;
 
-			if (opcode.pq.q == 0)
+			if constexpr (q == 0)
 			{
 				bus->Write(targetAddr, AF.b.hi);
-				DBG_MSG(", A");
+				DBG_MSG("LD ($%04x), A", targetAddr);
 			}
 			else
 			{
 				AF.b.hi = bus->Read(targetAddr);
+				DBG_MSG("LD A, ($%04x)", targetAddr);
 			}
 
 			cycles += 4;
-			break;
 		}
 
-			/////////////// 16 BIT INC/DEC ///////////////
-		case 3:
+		/////////////// 16 BIT INC/DEC ///////////////
+		else if constexpr (z == 3)
 		{
-			if (opcode.pq.q == 0)
+			if constexpr (q == 0)
 			{
-				rp[opcode.pq.p]->w++;
-				DBG_MSG("INC %s\t", REGNAME(rp[opcode.pq.p]));
+				RP<p>().w++;
+				DBG_MSG("INC %s\t", REGNAME((&RP<p>())));
 			}
 			else
 			{
-				rp[opcode.pq.p]->w--;
-				DBG_MSG("DEC %s\t", REGNAME(rp[opcode.pq.p]));
+				RP<p>().w--;
+				DBG_MSG("DEC %s\t", REGNAME((&RP<p>())));
 			}
 
 			cycles += 4;
-			break;
 		}
 
-			/////////////// 8 BIT INCREMENT ///////////////
-		case 4:
+		/////////////// 8 BIT INCREMENT ///////////////
+		else if constexpr (z == 4)
 		{
-			BYTE operand = ReadFromRegister(opcode.xyz.y);
-			flag->f.halfCarry = HALF_CARRY_ADD(operand, 1);
-			operand++;
+			BYTE operand = ReadR<y>();
+			DeferFlags(FLAGS_INC, operand, 1, operand + 1, CarryFlag());
 
-			flag->f.zero = !operand;
-			flag->f.negative = 0;
-
-			WriteToRegister(opcode.xyz.y, operand);
-			DBG_MSG("INC %s\t", operandNames[opcode.xyz.y]);
-			break;
+			WriteR<y>(operand + 1);
+			DBG_MSG("INC %s\t", operandNames[y]);
 		}
 
 		/////////////// 8 BIT DECREMENT ///////////////
-		case 5:
+		else if constexpr (z == 5)
 		{
-			BYTE operand = ReadFromRegister(opcode.xyz.y);
-			flag->f.halfCarry = HALF_CARRY_SUB(operand, 1);
-			operand--;
-
-			flag->f.zero = !operand;
-			flag->f.negative = 1;
+			BYTE operand = ReadR<y>();
+			DeferFlags(FLAGS_DEC, operand, 1, operand - 1, CarryFlag());
 
-			WriteToRegister(opcode.xyz.y, operand);
-			DBG_MSG("DEC %s\t", operandNames[opcode.xyz.y]);
-			break;
+			WriteR<y>(operand - 1);
+			DBG_MSG("DEC %s\t", operandNames[y]);
 		}
-			
-			/////////////// 8 BIT LOAD IMMEDIATE ///////////////
-		case 6:	
+
+		/////////////// 8 BIT LOAD IMMEDIATE ///////////////
+		else if constexpr (z == 6)
 		{
-			BYTE immVal = bus->Fetch(PC.w++);
-			WriteToRegister(opcode.xyz.y, immVal);
+			BYTE immVal = Immediate();
+			WriteR<y>(immVal);
 
 			cycles += 4;
-			DBG_MSG("LD %s, $%02x", operandNames[opcode.xyz.y], immVal);
-			break;
+			DBG_MSG("LD %s, $%02x", operandNames[y], immVal);
 		}
 
-			/////////////// ASSORTED OPS ON ACC ///////////////
-		case 7:
+		/////////////// ASSORTED OPS ON ACC ///////////////
+		else
 		{
-			switch (opcode.xyz.y)
+			SyncFlags();
+
+			if constexpr (y == 0)		// RLCA
 			{
-			case 0:		// RLCA
 				flag->f.carry = (AF.b.hi & 0x80) >> 7;
 				flag->f.negative = 0;
 				flag->f.halfCarry = 0;
@@ -351,9 +513,9 @@ void CPU::Tick()
 				flag->f.zero = 0;
 
 				DBG_MSG("RLCA\t");
-				break;
-
-			case 1:		// RRCA
+			}
+			else if constexpr (y == 1)	// RRCA
+			{
 				flag->f.carry = AF.b.hi & 0x01;
 				flag->f.negative = 0;
 				flag->f.halfCarry = 0;
@@ -363,10 +525,8 @@ void CPU::Tick()
 				flag->f.zero = 0;
 
 				DBG_MSG("RRCA\t");
-				break;
-				break;
-
-			case 2:		// RLA
+			}
+			else if constexpr (y == 2)	// RLA
 			{
 				BYTE oldCarry = flag->f.carry;
 				flag->f.carry = (AF.b.hi & 0x80) >> 7;
@@ -378,10 +538,8 @@ void CPU::Tick()
 				flag->f.zero = 0;
 
 				DBG_MSG("RLA\t");
-				break;
 			}
-
-			case 3:		// RRA
+			else if constexpr (y == 3)	// RRA
 			{
 				BYTE oldCarry = flag->f.carry;
 				flag->f.carry = AF.b.hi & 0x01;
@@ -393,10 +551,8 @@ void CPU::Tick()
 				flag->f.zero = 0;
 
 				DBG_MSG("RRA\t");
-				break;
 			}
-
-			case 4:		// DAA
+			else if constexpr (y == 4)	// DAA
 			{
 				BYTE correction = 0x00;
 
@@ -413,127 +569,93 @@ void CPU::Tick()
 				flag->f.halfCarry = 0;
 				flag->f.zero = !AF.b.hi;
 				DBG_MSG("DAA");
-				break;
 			}
-
-			case 5:		// CPL
+			else if constexpr (y == 5)	// CPL
+			{
 				AF.b.hi = ~AF.b.hi;
 
 				flag->f.negative = 1;
 				flag->f.halfCarry = 1;
 
 				DBG_MSG("CPL\t");
-				break;
-
-			case 6:		// SCF
+			}
+			else if constexpr (y == 6)	// SCF
+			{
 				flag->f.carry = 1;
 				flag->f.halfCarry = 0;
 				flag->f.negative = 0;
 
 				DBG_MSG("SCF\t");
-				break;
-
-			case 7:		// CCF
+			}
+			else						// CCF
+			{
 				flag->f.carry = !flag->f.carry;
 				flag->f.halfCarry = 0;
 				flag->f.negative = 0;
 
 				DBG_MSG("CCF\t");
-				break;
 			}
-
-			break;
-		}
-
-		default:
-			EXIT_MSG("Unknown opcode x-z octal: %u-%u", opcode.xyz.x, opcode.xyz.z);
-			bus->invalid = 1;
-			break;
 		}
-
-		break;
 	}
 
-		/////////////// X = 1 ///////////////
-	case 1:
+	/////////////// X = 1 ///////////////
+	else if constexpr (x == 1)
 	{
-		if (opcode.xyz.y == 6 && opcode.xyz.z == 6)	// HALT
+		if constexpr (y == 6 && z == 6)	// HALT
 		{
 			halted = true;
 			justHaltedWithDI = true;
 
 			DBG_MSG("HALT");
 		}
-		else					// LD r[y], r[z]
+		else							// LD r[y], r[z]
 		{
-			WriteToRegister(opcode.xyz.y, ReadFromRegister(opcode.xyz.z));
+			WriteR<y>(ReadR<z>());
 
-			DBG_MSG("LD %s, %s\t", operandNames[opcode.xyz.y], operandNames[opcode.xyz.z]);
+			DBG_MSG("LD %s, %s\t", operandNames[y], operandNames[z]);
 		}
-
-		break;
 	}
-	
+
 	/////////////// X = 2 ///////////////
-	case 2:
-		ALU(opcode.xyz.y, opcode.xyz.z);
-		break;
+	else if constexpr (x == 2)
+	{
+		ALU<y>(ReadR<z>());
+	}
 
-		/////////////// X = 3 ///////////////
-	case 3:
+	/////////////// X = 3 ///////////////
+	else
 	{
-		switch (opcode.xyz.z)
+		///////////////	CONDITIONAL RETURN & ASSORTED OPS ///////////////
+		if constexpr (z == 0)
 		{
-			///////////////	CONDITIONAL RETURN ///////////////
-		case 0:
-		{
-			bool condition;
-
-			switch (opcode.xyz.y)
+			if constexpr (y < 4)		// RET NZ, RET Z, RET NC, RET C
 			{
-			case 0:		// RET NZ
-				condition = !flag->f.zero;
-				DBG_MSG("RET NZ\t");
-				goto conditional_return;
-
-			case 1:		// RET Z
-				condition = flag->f.zero;
-				DBG_MSG("RET Z\t");
-				goto conditional_return;
-
-			case 2:		// RET NC
-				condition = !flag->f.carry;
-				DBG_MSG("RET NC\t");
-				goto conditional_return;
-
-			case 3:		// RET C
-				condition = flag->f.carry;
-				DBG_MSG("RET C\t");
-
-			conditional_return:
+				bool condition = Condition<y>();
 				if (condition)
 				{
 					PC.b.lo = POP();
 					PC.b.hi = POP();
+
+					if (profiler != nullptr)
+						profiler->Return(SP.w);
 				}
 
 				cycles += 4 + (12 * condition);
-				break;
-
-			case 4:
+				DBG_MSG("RET cc\t");
+			}
+			else if constexpr (y == 4)	// LD ($FF00 + n), A
 			{
-				BYTE offset = bus->Fetch(PC.w++);
+				BYTE offset = Immediate();
 				bus->Write((WORD)0xFF00 + offset, AF.b.hi);
 
 				cycles += 8;
 				DBG_MSG("LD ($FF%02x), A", offset);
-				break;
 			}
-
-			case 5:
+			else if constexpr (y == 5)	// ADD SP, d
 			{
-				char val = (char)(bus->Read(PC.w++));
+				char val = (char)Immediate();
 
+				SyncFlags();
 				flag->f.halfCarry = HALF_CARRY_ADD(SP.b.lo, val);
 				flag->f.carry = (((((SP.w) & 0xFF) + (val & 0xFF)) & 0x100) == 0x100);
 				flag->f.negative = 0;
@@ -542,23 +664,20 @@ void CPU::Tick()
 				SP.w += val;
 				cycles += 12;
 				DBG_MSG("ADD SP, $%02x", val);
-				break;
 			}
-
-			case 6:
+			else if constexpr (y == 6)	// LD A, ($FF00 + n)
 			{
-				BYTE offset = bus->Fetch(PC.w++);
+				BYTE offset = Immediate();
 				AF.b.hi = bus->Read((WORD)0xFF00 + offset);
 
 				cycles += 8;
 				DBG_MSG("LD A, ($FF%02x)", offset);
-				break;
 			}
-
-			case 7:
+			else						// LD HL, SP + d
 			{
-				char val = (char)bus->Fetch(PC.w++);
+				char val = (char)Immediate();
 
+				SyncFlags();
 				flag->f.halfCarry = HALF_CARRY_ADD(SP.b.lo, val);
 				flag->f.carry = (((((SP.w) & 0xFF) + (val & 0xFF)) & 0x100) == 0x100);
 				flag->f.zero = 0;
@@ -567,209 +686,161 @@ void CPU::Tick()
 				HL.w = SP.w + val;
 				cycles += 8;
 				DBG_MSG("LD HL, SP+$%02x", val);
-				break;
-			}
 			}
-			break;
 		}
 
-			///////////////	POP & VARIOUS OPS ///////////////
-		case 1:
+		///////////////	POP & VARIOUS OPS ///////////////
+		else if constexpr (z == 1)
 		{
-			if (opcode.pq.q == 0)
+			if constexpr (q == 0)		// POP rp2[p]
 			{
-				rp2[opcode.pq.p]->b.lo = POP() & (~((opcode.pq.p == 3) * 0x0F));		// If reg is AF, then F must be & with 0xF0
-				rp2[opcode.pq.p]->b.hi = POP();
+				if constexpr (p == 3)
+					lazyFlags.op = FLAGS_SYNCED;	// Whatever was pending is getting overwritten anyways
+
+				RP2<p>().b.lo = POP() & (~((p == 3) * 0x0F));		// If reg is AF, then F must be & with 0xF0
+				RP2<p>().b.hi = POP();
 
 				cycles += 8;
-				DBG_MSG("POP %s\t", rp2[opcode.pq.p]->name);
+				DBG_MSG("POP %s\t", RP2<p>().name);
 			}
-			else
+			else if constexpr (p == 0)	// RET
 			{
-				switch (opcode.pq.p)
-				{
-				case 0:		// RET
-					PC.b.lo = POP();
-					PC.b.hi = POP();
-					
-					cycles += 12;
-					DBG_MSG("RET\t");
-					break;
-
-				case 1:		// RETI
-					ime = 1;
-					PC.b.lo = POP();
-					PC.b.hi = POP();
-
-					cycles += 12;
-					DBG_MSG("RETI\t");
-					break;
+				PC.b.lo = POP();
+				PC.b.hi = POP();
+				if (profiler != nullptr)
+					profiler->Return(SP.w);
 
-				case 2:		// JP (HL)
-					PC.w = HL.w;
-
-					DBG_MSG("JP (HL)\t");
-					break;
+				cycles += 12;
+				DBG_MSG("RET\t");
+			}
+			else if constexpr (p == 1)	// RETI
+			{
+				ime = 1;
+				PC.b.lo = POP();
+				PC.b.hi = POP();
+				if (profiler != nullptr)
+					profiler->Return(SP.w);
 
-				case 3:		// LD SP, HL
-					SP.w = HL.w;
+				cycles += 12;
+				DBG_MSG("RETI\t");
+			}
+			else if constexpr (p == 2)	// JP (HL)
+			{
+				PC.w = HL.w;
 
-					DBG_MSG("LD SP, HL");
-					cycles += 4;
-					break;
-				}
+				DBG_MSG("JP (HL)\t");
 			}
+			else						// LD SP, HL
+			{
+				SP.w = HL.w;
 
-			break;
+				DBG_MSG("LD SP, HL");
+				cycles += 4;
+			}
 		}
 
-			///////////////	CONDITIONAL JUMPS ///////////////
-		case 2:
+		///////////////	CONDITIONAL JUMPS & ASSORTED LOADS ///////////////
+		else if constexpr (z == 2)
 		{
-			bool condition;
 			Register addr;
 			addr.w = 0;
 
-			switch (opcode.xyz.y)
+			if constexpr (y < 4)		// JP NZ, JP Z, JP NC, JP C
 			{
-			case 0:		// JP NZ
-				condition = !flag->f.zero;
-				DBG_MSG("JP NZ, ");
-				goto conditional_jump;
-
-			case 1:		// JP Z
-				condition = flag->f.zero;
-				DBG_MSG("JP Z, ");
-				goto conditional_jump;
-
-			case 2:		// JP NC
-				condition = !flag->f.carry;
-				DBG_MSG("JP NC, ");
-				goto conditional_jump;
-
-			case 3:		// JP C
-				condition = flag->f.carry;
-				DBG_MSG("JP C, ");
-
-			conditional_jump:
-				addr.b.lo = bus->Fetch(PC.w++);
-				addr.b.hi = bus->Fetch(PC.w++);
+				bool condition = Condition<y>();
+				addr.b.lo = Immediate();
+				addr.b.hi = Immediate();
 
 				if (condition) PC.w = addr.w;
 				cycles += 8 + (4 * condition);
-				DBG_MSG("$%04x", addr.w);
-				break;
+				DBG_MSG("JP cc, $%04x", addr.w);
 
-			case 4:
+				if (condition && addr.w <= opcodeAddress)
+					CheckIdleLoop(opcodeAddress);
+			}
+			else if constexpr (y == 4)	// LD ($FF00 + C), A
+			{
 				bus->Write((WORD)0xFF00 + BC.b.lo, AF.b.hi);
 
 				cycles += 4;
 				DBG_MSG("LD ($FF%02x), A", BC.b.lo);
-				break;
-
-			case 5:
-				addr.b.lo = bus->Fetch(PC.w++);
-				addr.b.hi = bus->Fetch(PC.w++);
+			}
+			else if constexpr (y == 5)	// LD (nn), A
+			{
+				addr.b.lo = Immediate();
+				addr.b.hi = Immediate();
 				bus->Write(addr.w, AF.b.hi);
 
 				cycles += 12;
 				DBG_MSG("LD ($%04x), A", addr.w);
-				break;
-
-			case 6:
+			}
+			else if constexpr (y == 6)	// LD A, ($FF00 + C)
+			{
 				AF.b.hi = bus->Read((WORD)0xFF00 + BC.b.lo);
 
 				cycles += 4;
 				DBG_MSG("LD A, ($FF%02x)", BC.b.lo);
-				break;
-
-			case 7:
-				addr.b.lo = bus->Fetch(PC.w++);
-				addr.b.hi = bus->Fetch(PC.w++);
+			}
+			else						// LD A, (nn)
+			{
+				addr.b.lo = Immediate();
+				addr.b.hi = Immediate();
 				AF.b.hi = bus->Read(addr.w);
 
 				cycles += 12;
 				DBG_MSG("LD A, ($%04x)", addr.w);
-				break;
 			}
-
-			break;
 		}
 
-			/////////////// ASSORTED OPERATIONS ///////////////
-		case 3:
+		/////////////// ASSORTED OPERATIONS ///////////////
+		else if constexpr (z == 3)
 		{
-			switch (opcode.xyz.y)
-			{
-			case 0:	// JP nn
+			if constexpr (y == 0)		// JP nn
 			{
 				Register addr;
-				addr.b.lo = bus->Read(PC.w++);
-				addr.b.hi = bus->Read(PC.w++);
+				addr.b.lo = Immediate();
+				addr.b.hi = Immediate();
 
 				PC.w = addr.w;
 
 				cycles += 12;
 				DBG_MSG("JP, $%04x", addr.w);
-				break;
-			}
-
-				/////////////// CB PREFIXED ///////////////
-			case 1:
-				CBPrefixed();
-				break;
 
-				/////////////// INTERRUPTS ENABLE / DISABLE ///////////////
-			case 6:
+				if (addr.w <= opcodeAddress)
+					CheckIdleLoop(opcodeAddress);
+			}
+			else if constexpr (y == 1)	// CB prefixed, those get their own table
+			{
+				// Decode() puts the handler from cbHandlers into the decoded instruction
+				// instead of this one, so nobody ever ends up here
+				assert(false);
+			}
+			else if constexpr (y == 6)	// DI
+			{
 				ime = 0;
 				DBG_MSG("DI\t");
-				break;
-
-			case 7:
+			}
+			else if constexpr (y == 7)	// EI
+			{
 				ime = 1;
 				DBG_MSG("EI\t");
-				break;
-
-			default:
-				EXIT_MSG("Unknown opcode x-z-y octal: %u-%u-%u", opcode.xyz.x, opcode.xyz.z, opcode.xyz.y);
+			}
+			else
+			{
+				EXIT_MSG("Unknown opcode x-z-y octal: %u-%u-%u", x, z, y);
 				bus->invalid = 1;
-				break;
 			}
-
-			break;
 		}
 
-			/////////////// CONDITION CALL ///////////////
-		case 4:
+		/////////////// CONDITION CALL ///////////////
+		else if constexpr (z == 4)
 		{
-			bool condition = true;
-
-			switch (opcode.xyz.y)
+			if constexpr (y < 4)		// CALL NZ, CALL Z, CALL NC, CALL C
 			{
-
-			case 0:	
-				condition = !flag->f.zero;	
-				DBG_MSG("CALL NZ, ");
-				goto conditional_call;
-
-			case 1:	
-				condition = flag->f.zero;	
-				DBG_MSG("CALL Z, ");
-				goto conditional_call;
-
-			case 2:	
-				condition = !flag->f.carry;	
-				DBG_MSG("CALL NC, ");
-				goto conditional_call;
-
-			case 3:	
-				condition = flag->f.carry;	
-				DBG_MSG("CALL C, ");
-
-			conditional_call:
+				bool condition = Condition<y>();
 				Register addr;
-				addr.b.lo = bus->Fetch(PC.w++);
-				addr.b.hi = bus->Fetch(PC.w++);
+				addr.b.lo = Immediate();
+				addr.b.hi = Immediate();
 
 				if (condition)
 				{
@@ -777,401 +848,558 @@ void CPU::Tick()
 					PUSH(PC.b.lo);
 
 					PC.w = addr.w;
+					if (profiler != nullptr)
+						profiler->Call(PC.w, SP.w);
 				}
 
 				cycles += 8 + (12 * condition);
-				DBG_MSG("$%04x", addr.w);
-				break;
+				DBG_MSG("CALL cc, $%04x", addr.w);
 			}
 
-			break;
+			// y = 4..7 don't exist, and they never did anything here
 		}
 
-			///////////////	PUSH & VARIOUS OPS ///////////////
-		case 5:
+		///////////////	PUSH & VARIOUS OPS ///////////////
+		else if constexpr (z == 5)
 		{
-			if (opcode.pq.q == 0)
+			if constexpr (q == 0)		// PUSH rp2[p]
 			{
-				PUSH(rp2[opcode.pq.p]->b.hi);
-				PUSH(rp2[opcode.pq.p]->b.lo);
+				if constexpr (p == 3)
+					SyncFlags();
+
+				PUSH(RP2<p>().b.hi);
+				PUSH(RP2<p>().b.lo);
 
 				cycles += 12;
-				DBG_MSG("PUSH %s\t", rp2[opcode.pq.p]->name);
+				DBG_MSG("PUSH %s\t", RP2<p>().name);
 			}
-			else
+			else if constexpr (p == 0)	// CALL nn
 			{
-				if (opcode.pq.p == 0)
-				{
-					Register addr;
-					addr.b.lo = bus->Fetch(PC.w++);
-					addr.b.hi = bus->Fetch(PC.w++);
+				Register addr;
+				addr.b.lo = Immediate();
+				addr.b.hi = Immediate();
 
-					PUSH(PC.b.hi);
-					PUSH(PC.b.lo);
+				PUSH(PC.b.hi);
+				PUSH(PC.b.lo);
 
-					PC.w = addr.w;
+				PC.w = addr.w;
+				if (profiler != nullptr)
+					profiler->Call(PC.w, SP.w);
 
-					cycles += 20;
-					DBG_MSG("CALL $%04x", addr.w);
-				}
+				cycles += 20;
+				DBG_MSG("CALL $%04x", addr.w);
 			}
-
-			break;
 		}
 
-			/////////////// ALU ///////////////
-		case 6:
-			ALU(opcode.xyz.y, bus->Fetch(PC.w++));
-			break;
+		/////////////// ALU ///////////////
+		else if constexpr (z == 6)
+		{
+			cycles += 4;
+			ALU<y>(Immediate());
+		}
 
-			/////////////// RST ///////////////
-		case 7:
+		/////////////// RST ///////////////
+		else
+		{
 			PUSH(PC.b.hi);
 			PUSH(PC.b.lo);
 
 			PC.b.hi = 0x00;
-			PC.b.lo = 8 * opcode.xyz.y;
+			PC.b.lo = 8 * y;
+			if (profiler != nullptr)
+				profiler->Call(PC.w, SP.w);
 
 			cycles += 12;
 			DBG_MSG("RST %02xh", PC.b.lo);
-			break;
-
-		default:
-			EXIT_MSG("Unknown opcode x-z octal: %u-%u", opcode.xyz.x, opcode.xyz.z);
-			bus->invalid = 1;
-			break;
 		}
+	}
+}
 
-		break;
+// A lot of games wait for something (V-Blank, a flag set by an interrupt handler, ...) by spinning
+// in a tight loop reading the same thing over and over. If one iteration of such a loop didn't
+// write anything and the registers look exactly the same as after the previous one, then the
+// next iteration is going to do the exact same thing again. And the one after that. Until some
+// event changes whatever is being polled, so the bus may as well skip ahead to that
+void CPU::CheckIdleLoop(WORD branch)
+{
+	if (!idleLoopDetection || branch - PC.w > IDLE_LOOP_MAX_LENGTH)
+		return;
+
+	SyncFlags();		// We're comparing AF
+
+	bool sameLoop = (idleLoop.branch == branch && idleLoop.start == PC.w);
+	if (
+		sameLoop &&
+		idleLoop.writes == bus->writes && !(bus->idleReads & IDLE_READ_TIMER) &&
+		idleLoop.af == AF.w && idleLoop.bc == BC.w && idleLoop.de == DE.w &&
+		idleLoop.hl == HL.w && idleLoop.sp == SP.w && idleLoop.ime == ime
+		)
+	{
+		idlePeriod = bus->internalCounter - idleLoop.cycle;
+
+		idleStats.hits++;
+		idleStats.loops[PC.w]++;
+	}
+	else if (sameLoop)
+	{
+		CheckBulkLoop(branch);
 	}
 
-	default:
-		EXIT_MSG("Unknown opcode octal x: %u", opcode.xyz.x);
-		bus->invalid = 1;
-		break;
+	// Either way, this is where the next iteration starts
+	idleLoop.start = PC.w;
+	idleLoop.branch = branch;
+	idleLoop.af = AF.w;
+	idleLoop.bc = BC.w;
+	idleLoop.de = DE.w;
+	idleLoop.hl = HL.w;
+	idleLoop.sp = SP.w;
+	idleLoop.ime = ime;
+	idleLoop.interrupt = ime && (interruptEnable.b & interruptFlag.b);
+	idleLoop.cycle = bus->internalCounter;
+	idleLoop.writes = bus->writes;
+
+	if (!idlePeriod)
+		bus->idleReads = 0;
+}
+
+// What copy and fill loops look like. The counter comes after this, then a JR NZ/JP NZ back to the start
+struct BulkPattern
+{
+	BYTE length;
+	BYTE bytes[3];
+	BYTE type;		// BULK_FROM_xx for the copies, BULK_COUNTER_xx for the counters
+	signed char hlStep;
+};
+
+static const BulkPattern bulkBodies[] = {
+	{ 3, { 0x2A, 0x12, 0x13 },	BULK_FROM_HL,	 1 },
+	{ 3, { 0x1A, 0x22, 0x13 },	BULK_FROM_DE,	 1 },
+	{ 1, { 0x22 },				BULK_FROM_A,	 1 },
+	{ 1, { 0x32 },				BULK_FROM_A,	-1 },
+	{ 2, { 0xAF, 0x22 },		BULK_ZERO,		 1 },
+};
+
+static const BulkPattern bulkCounters[] = {
+	{ 1, { 0x05 },				BULK_COUNTER_B,	 0 },
+	{ 1, { 0x0D },				BULK_COUNTER_C,	 0 },
+	{ 3, { 0x0B, 0x78, 0xB1 },	BULK_COUNTER_BC, 0 },
+};
+
+// Games spend a lot of time copying tiles and clearing RAM with the same handful of loops. Once one
+// of those went around once without being disturbed, we know how long an iteration takes, and the
+// bus can do the rest of them in one go (see Bus::RunBulkLoop())
+void CPU::CheckBulkLoop(WORD branch)
+{
+	// The last iteration has to have run undisturbed for its length to mean anything
+	if (bus->lastEvent > idleLoop.cycle || idleLoop.interrupt)
+		return;
+
+	// All of these are made of one byte instructions, and the loop is only a few of them long
+	BYTE code[12];
+	WORD start = PC.w;
+	size_t length = (WORD)(branch - start);
+	if (length + 3 > sizeof(code))
+		return;
+
+	for (size_t i = 0; i < length + 3; i++)
+	{
+		if (!bus->IsPlainMemory(start + i, false))
+			return;
+
+		code[i] = bus->Read(start + i);
 	}
 
-	DBG_MSG("\t\t AF: %04x  BC: %04x  DE: %04x  HL: %04x  SP: %04x  F: %u%u%u%u", AF.w, BC.w, DE.w, HL.w, SP.w, flag->f.zero, flag->f.negative, flag->f.halfCarry, flag->f.carry);
-	DBG_MSG("\t (LY: %03u  SC: %03u  FC: %05u)\n", bus->lcd->ly, bus->lcd->scanlineCycles, bus->lcd->cycles);
+	// Only the conditional jumps can ever end the loop
+	if (code[length] != 0x20 && code[length] != 0xC2)
+		return;
 
-}
+	for (const BulkPattern& body : bulkBodies)
+	{
+		if (body.length >= length || memcmp(code, body.bytes, body.length))
+			continue;
 
+		for (const BulkPattern& counter : bulkCounters)
+		{
+			if (body.length + counter.length != length || memcmp(code + body.length, counter.bytes, counter.length))
+				continue;
+
+			// LD A, B; OR C changes what's being filled with every iteration
+			if (body.type == BULK_FROM_A && counter.type == BULK_COUNTER_BC)
+				return;
+
+			bulkLoop.source = body.type;
+			bulkLoop.counter = counter.type;
+			bulkLoop.hlStep = body.hlStep;
+			bulkLoop.start = start;
+			bulkLoop.end = branch + ((code[length] == 0x20) ? 1 : 2);
+			bulkLoop.period = bus->internalCounter - idleLoop.cycle;
+			return;
+		}
+	}
+}
 
-inline void CPU::WriteToRegister(BYTE reg, BYTE val)
+// Same as the old WriteToRegister()/ReadFromRegister() switches, except the register is known at compile time
+template<BYTE reg>
+inline void CPU::WriteR(BYTE val)
 {
-	switch (reg)
+	if constexpr (reg == 0)			BC.b.hi = val;
+	else if constexpr (reg == 1)	BC.b.lo = val;
+	else if constexpr (reg == 2)	DE.b.hi = val;
+	else if constexpr (reg == 3)	DE.b.lo = val;
+	else if constexpr (reg == 4)	HL.b.hi = val;
+	else if constexpr (reg == 5)	HL.b.lo = val;
+	else if constexpr (reg == 6)
 	{
-	case 0:	BC.b.hi = val;	break;
-	case 1:	BC.b.lo = val;	break;
-	case 2: DE.b.hi = val;	break;
-	case 3: DE.b.lo = val;	break;
-	case 4: HL.b.hi = val;	break;
-	case 5: HL.b.lo = val;	break;
-	case 6:
-		cycles += 4;
+		cycles += 4;				// The cycles, the god DAMN CPU CYCLES
 		bus->Write(HL.w, val);
-		break;
-	case 7: AF.b.hi = val;	break;
 	}
+	else							AF.b.hi = val;
 }
 
-inline BYTE CPU::ReadFromRegister(BYTE reg)
+template<BYTE reg>
+inline BYTE CPU::ReadR()
 {
-	switch (reg)
+	if constexpr (reg == 0)			return BC.b.hi;
+	else if constexpr (reg == 1)	return BC.b.lo;
+	else if constexpr (reg == 2)	return DE.b.hi;
+	else if constexpr (reg == 3)	return DE.b.lo;
+	else if constexpr (reg == 4)	return HL.b.hi;
+	else if constexpr (reg == 5)	return HL.b.lo;
+	else if constexpr (reg == 6)
 	{
-	case 0:	return BC.b.hi;
-	case 1:	return BC.b.lo;
-	case 2: return DE.b.hi;
-	case 3: return DE.b.lo;
-	case 4: return HL.b.hi;
-	case 5: return HL.b.lo;
-	case 6:
 		cycles += 4;
 		return bus->Read(HL.w);
-	case 7: return AF.b.hi;
 	}
+	else							return AF.b.hi;
+}
 
-	return 0xFF;
+template<BYTE p>
+inline Register& CPU::RP()
+{
+	if constexpr (p == 0)			return BC;
+	else if constexpr (p == 1)		return DE;
+	else if constexpr (p == 2)		return HL;
+	else							return SP;
 }
 
-inline void CPU::ALU(BYTE operation, BYTE operand)
+template<BYTE p>
+inline Register& CPU::RP2()
 {
-	BYTE val = 0;
-#ifndef NDEBUG
-	char printString[10] = "";
-	if (opcode.xyz.x == 2)
-		sprintf(printString, "%s", operandNames[operand]);
-	else
-		sprintf(printString, "$%02x", operand);
-#endif
+	if constexpr (p == 0)			return BC;
+	else if constexpr (p == 1)		return DE;
+	else if constexpr (p == 2)		return HL;
+	else							return AF;
+}
 
-	if (opcode.xyz.x == 2)
+// NZ, Z, NC, C
+template<BYTE cc>
+inline bool CPU::Condition()
+{
+	if constexpr (cc == 0)			return !ZeroFlag();
+	else if constexpr (cc == 1)		return ZeroFlag();
+	else if constexpr (cc == 2)		return !CarryFlag();
+	else							return CarryFlag();
+}
+
+// The flags are left alone here, we just remember what happened (see SyncFlags())
+template<BYTE operation>
+inline void CPU::ALU(BYTE val)
+{
+	BYTE a = AF.b.hi;
+
+	if constexpr (operation == 0)		// ADD
 	{
-		val = ReadFromRegister(operand);
+		AF.b.hi = a + val;
+		DeferFlags(FLAGS_ADD, a, val, AF.b.hi, 0);
+		DBG_MSG("ADD A, $%02x", val);
 	}
-	else
+	else if constexpr (operation == 1)	// ADC
 	{
-		val = operand;
-		cycles += 4;
+		BYTE carry = CarryFlag();
+		AF.b.hi = a + val + carry;
+		DeferFlags(FLAGS_ADC, a, val, AF.b.hi, carry);
+		DBG_MSG("ADC A, $%02x", val);
 	}
-	
-
-	switch (operation)
+	else if constexpr (operation == 2)	// SUB
+	{
+		AF.b.hi = a - val;
+		DeferFlags(FLAGS_SUB, a, val, AF.b.hi, 0);
+		DBG_MSG("SUB A, $%02x", val);
+	}
+	else if constexpr (operation == 3)	// SBC
+	{
+		BYTE carry = CarryFlag();
+		AF.b.hi = a - val - carry;
+		DeferFlags(FLAGS_SBC, a, val, AF.b.hi, carry);
+		DBG_MSG("SBC A, $%02x", val);
+	}
+	else if constexpr (operation == 4)	// AND
+	{
+		AF.b.hi = a & val;
+		DeferFlags(FLAGS_AND, a, val, AF.b.hi, 0);
+		DBG_MSG("AND A, $%02x\t", val);
+	}
+	else if constexpr (operation == 5)	// XOR
+	{
+		AF.b.hi = a ^ val;
+		DeferFlags(FLAGS_LOGIC, a, val, AF.b.hi, 0);
+		DBG_MSG("XOR A, $%02x", val);
+	}
+	else if constexpr (operation == 6)	// OR
+	{
+		AF.b.hi = a | val;
+		DeferFlags(FLAGS_LOGIC, a, val, AF.b.hi, 0);
+		DBG_MSG("OR A, $%02x\t", val);
+	}
+	else								// CP
 	{
-	case 0:			// ADD
-		flag->f.halfCarry = HALF_CARRY_ADD(AF.b.hi, val);
-		flag->f.carry = (0xFF - val < AF.b.hi);
-		AF.b.hi += val;
+		DeferFlags(FLAGS_SUB, a, val, a - val, 0);		// It's a SUB that forgets the result
+		DBG_MSG("CP A, $%02x", val);
+	}
+}
 
-		flag->f.zero = !AF.b.hi;
-		flag->f.negative = 0;
+/*
+	Lazy flags
+	Most instructions that set flags are followed by another one that overwrites them before
+	anyone had a look. So the ALU and INC/DEC only write down what they did, and F gets
+	calculated from that once someone actually needs it. Conditions only need Z or C, and
+	those are cheap to get without building the whole thing.
+	Everything else that reads or partially updates the flags has to call SyncFlags() first.
+	Compile with EAGER_FLAGS to have the flags calculated right away, to check if a bug has
+	anything to do with this
+*/
+inline void CPU::DeferFlags(BYTE op, BYTE a, BYTE b, BYTE result, BYTE carry)
+{
+	lazyFlags.op = op;
+	lazyFlags.a = a;
+	lazyFlags.b = b;
+	lazyFlags.result = result;
+	lazyFlags.carry = carry;
+
+#ifdef EAGER_FLAGS
+	SyncFlags();
+#endif
+}
 
-		DBG_MSG("ADD A, %s", printString);
-		break;
+void CPU::SyncFlags()
+{
+	if (lazyFlags.op == FLAGS_SYNCED)
+		return;
 
-	case 1:		// ADC
-	{
-		WORD result = (WORD)AF.b.hi + val + flag->f.carry;
-		flag->f.halfCarry = ((((AF.b.hi & val) | ((AF.b.hi ^ val) & ~(AF.b.hi + val + flag->f.carry))) & 0x08) == 0x08);
-		flag->f.carry = (result & 0x100) == 0x100;
-		AF.b.hi = (BYTE)result;
+	BYTE a = lazyFlags.a;
+	BYTE b = lazyFlags.b;
+	BYTE c = lazyFlags.carry;
 
-		flag->f.zero = !AF.b.hi;
+	// These are the exact same formulas the ALU used to use
+	flag->f.zero = !lazyFlags.result;
+	switch (lazyFlags.op)
+	{
+	case FLAGS_ADD:
 		flag->f.negative = 0;
-
-		DBG_MSG("ADC A, %s", printString);
+		flag->f.halfCarry = HALF_CARRY_ADD(a, b);
+		flag->f.carry = (0xFF - b < a);
 		break;
-	}
 
-	case 2:		// SUB
-		flag->f.halfCarry = HALF_CARRY_SUB(AF.b.hi, val);
-		flag->f.carry = (AF.b.hi < val);
-		AF.b.hi -= val;
+	case FLAGS_ADC:
+		flag->f.negative = 0;
+		flag->f.halfCarry = ((((a & b) | ((a ^ b) & ~(a + b + c))) & 0x08) == 0x08);
+		flag->f.carry = (((WORD)a + b + c) & 0x100) == 0x100;
+		break;
 
-		flag->f.zero = !AF.b.hi;
+	case FLAGS_SUB:
 		flag->f.negative = 1;
-
-		DBG_MSG("SUB A, %s", printString);
+		flag->f.halfCarry = HALF_CARRY_SUB(a, b);
+		flag->f.carry = (a < b);
 		break;
 
-	case 3:		// SBC
-	{
-		int result = AF.b.hi - val - flag->f.carry;
-		
-		flag->f.halfCarry = (((AF.b.hi & 0x0F) - (val & 0x0F) - flag->f.carry) < 0);
-		flag->f.carry = (result < 0);
+	case FLAGS_SBC:
 		flag->f.negative = 1;
-
-		AF.b.hi = (BYTE)result;
-		flag->f.zero = !AF.b.hi;
-
-		DBG_MSG("SBC A, %s", printString);
+		flag->f.halfCarry = (((a & 0x0F) - (b & 0x0F) - c) < 0);
+		flag->f.carry = ((a - b - c) < 0);
 		break;
-	}
-
-	case 4:
-		AF.b.hi &= val;
 
-		flag->f.zero = !AF.b.hi;
+	case FLAGS_AND:
 		flag->f.negative = 0;
 		flag->f.halfCarry = 1;
 		flag->f.carry = 0;
-
-		DBG_MSG("AND A, %s\t", printString);
 		break;
 
-	case 5:		// XOR
-		AF.b.hi ^= val;
-
-		flag->f.zero = !AF.b.hi;
+	case FLAGS_LOGIC:
 		flag->f.negative = 0;
 		flag->f.halfCarry = 0;
 		flag->f.carry = 0;
-
-		DBG_MSG("XOR A, %s", printString);
 		break;
 
-	case 6:		// OR
-		AF.b.hi |= val;
-
-		flag->f.zero = !AF.b.hi;
+	case FLAGS_INC:
 		flag->f.negative = 0;
-		flag->f.halfCarry = 0;
-		flag->f.carry = 0;
-
-		DBG_MSG("OR A, %s\t", printString);
+		flag->f.halfCarry = HALF_CARRY_ADD(a, 1);
+		flag->f.carry = c;
 		break;
 
-	case 7:		// CP
-	{
-		WORD result = AF.b.hi - val;
-
-		flag->f.zero = !result;
+	case FLAGS_DEC:
 		flag->f.negative = 1;
-		flag->f.halfCarry = HALF_CARRY_SUB(AF.b.hi, val);
-		flag->f.carry = (AF.b.hi < val);
-
-		DBG_MSG("CP A, %s", printString);
+		flag->f.halfCarry = HALF_CARRY_SUB(a, 1);
+		flag->f.carry = c;
 		break;
 	}
 
-	default:
-		EXIT_MSG("Unknown ALU operation: %u", operation);
-		bus->invalid = true;
-		break;
-	}
+	lazyFlags.op = FLAGS_SYNCED;
 }
 
-inline void CPU::CBPrefixed()
+inline bool CPU::ZeroFlag()
 {
-	opcode.b = bus->Fetch(PC.w++);
-	cycles += 8;
-	BYTE val = ReadFromRegister(opcode.xyz.z);
-
-	switch (opcode.xyz.x)
-	{
-	case 0:
-	{
-		switch (opcode.xyz.y)
-		{
-		case 0:	// RLC
-			flag->f.carry = (val & 0x80) >> 7;
-			flag->f.negative = 0;
-			flag->f.halfCarry = 0;
-
-			val <<= 1;
-			val ^= (-flag->f.carry ^ val) & 0x1;
-			flag->f.zero = !val;
-
-			DBG_MSG("RLC %s\t", operandNames[opcode.xyz.z]);
-			break;
-
-		case 1:	// RLL
-			flag->f.carry = val & 0x01;
-			flag->f.negative = 0;
-			flag->f.halfCarry = 0;
-
-			val >>= 1;
-			val ^= (-flag->f.carry ^ val) & 0x80;
-			flag->f.zero = !val;
-
-			DBG_MSG("RLL %s\t", operandNames[opcode.xyz.z]);
-			break;
-
-		case 2:	// RL
-		{
-			BYTE oldCarry = flag->f.carry;
-			flag->f.carry = (val & 0x80) >> 7;
-			flag->f.negative = 0;
-			flag->f.halfCarry = 0;
-
-			val <<= 1;
-			val ^= (-oldCarry ^ val) & 0x1;
-			flag->f.zero = !val;
-
-			DBG_MSG("RL %s\t", operandNames[opcode.xyz.z]);
-			break;
-		}
-
-		case 3:	// RR
-		{
-			BYTE oldCarry = flag->f.carry;
-			flag->f.carry = val & 0x01;
-			flag->f.negative = 0;
-			flag->f.halfCarry = 0;
+	if (lazyFlags.op == FLAGS_SYNCED)
+		return flag->f.zero;
 
-			val >>= 1;
-			val ^= (-oldCarry ^ val) & 0x80;
-			flag->f.zero = !val;
-
-			DBG_MSG("RR %s\t", operandNames[opcode.xyz.z]);
-			break;
-		}
-
-		case 4:	// SLA
-		{
-			flag->f.carry = (val & 0x80) >> 7;
-			flag->f.negative = 0;
-			flag->f.halfCarry = 0;
-
-			val <<= 1;
-			flag->f.zero = !val;
-
-			DBG_MSG("SLA %s\t", operandNames[opcode.xyz.z]);
-			break;
-		}
-
-		case 5:	// SRA
-		{
-			flag->f.carry = val & 0x01;
-			flag->f.negative = 0;
-			flag->f.halfCarry = 0;
+	return !lazyFlags.result;
+}
 
-			BYTE rMask = (val & 0x80);
-			val = (val >> 1) | rMask;
-			flag->f.zero = !val;
+// Direct access to an 8 bit register. Only for actual registers, (HL) has to go through the bus
+template<BYTE reg>
+inline BYTE& CPU::Register8()
+{
+	static_assert(reg != 6, "(HL) is not a register");
+
+	if constexpr (reg == 0)			return BC.b.hi;
+	else if constexpr (reg == 1)	return BC.b.lo;
+	else if constexpr (reg == 2)	return DE.b.hi;
+	else if constexpr (reg == 3)	return DE.b.lo;
+	else if constexpr (reg == 4)	return HL.b.hi;
+	else if constexpr (reg == 5)	return HL.b.lo;
+	else							return AF.b.hi;
+}
 
-			DBG_MSG("SRA %s\t", operandNames[opcode.xyz.z]);
-			break;
-		}
+// Everything a CB prefixed instruction does to its operand. Returns the new value (BIT doesn't have one)
+template<CBOp operation, BYTE bit>
+inline BYTE CPU::CBOperate(BYTE val)
+{
+	if constexpr (operation != CBOp::RES && operation != CBOp::SET)
+		SyncFlags();
 
-		case 6:		// SWAP
-		{
-			BYTE loNibble = val & 0x0F;
-			flag->f.carry = 0;
-			flag->f.negative = 0;
-			flag->f.halfCarry = 0;
+	if constexpr (operation == CBOp::RLC)
+	{
+		flag->f.carry = (val & 0x80) >> 7;
+		flag->f.negative = 0;
+		flag->f.halfCarry = 0;
 
-			val = (val >> 4) | (loNibble << 4);
-			flag->f.zero = !val;
+		val <<= 1;
+		val ^= (-flag->f.carry ^ val) & 0x1;
+		flag->f.zero = !val;
+	}
+	else if constexpr (operation == CBOp::RRC)
+	{
+		flag->f.carry = val & 0x01;
+		flag->f.negative = 0;
+		flag->f.halfCarry = 0;
 
-			DBG_MSG("SWAP %s\t", operandNames[opcode.xyz.z]);
-			break;
-		}
+		val >>= 1;
+		val ^= (-flag->f.carry ^ val) & 0x80;
+		flag->f.zero = !val;
+	}
+	else if constexpr (operation == CBOp::RL)
+	{
+		BYTE oldCarry = flag->f.carry;
+		flag->f.carry = (val & 0x80) >> 7;
+		flag->f.negative = 0;
+		flag->f.halfCarry = 0;
 
-		case 7:	// SRL
-		{
-			flag->f.carry = val & 0x01;
-			flag->f.negative = 0;
-			flag->f.halfCarry = 0;
+		val <<= 1;
+		val ^= (-oldCarry ^ val) & 0x1;
+		flag->f.zero = !val;
+	}
+	else if constexpr (operation == CBOp::RR)
+	{
+		BYTE oldCarry = flag->f.carry;
+		flag->f.carry = val & 0x01;
+		flag->f.negative = 0;
+		flag->f.halfCarry = 0;
 
-			val >>= 1;
-			flag->f.zero = !val;
+		val >>= 1;
+		val ^= (-oldCarry ^ val) & 0x80;
+		flag->f.zero = !val;
+	}
+	else if constexpr (operation == CBOp::SLA)
+	{
+		flag->f.carry = (val & 0x80) >> 7;
+		flag->f.negative = 0;
+		flag->f.halfCarry = 0;
 
-			DBG_MSG("SRL %s\t", operandNames[opcode.xyz.z]);
-			break;
-		}
+		val <<= 1;
+		flag->f.zero = !val;
+	}
+	else if constexpr (operation == CBOp::SRA)
+	{
+		flag->f.carry = val & 0x01;
+		flag->f.negative = 0;
+		flag->f.halfCarry = 0;
 
-		}
+		val = (val >> 1) | (val & 0x80);
+		flag->f.zero = !val;
+	}
+	else if constexpr (operation == CBOp::SWAP)
+	{
+		flag->f.carry = 0;
+		flag->f.negative = 0;
+		flag->f.halfCarry = 0;
 
-		break;
+		val = (val >> 4) | (val << 4);
+		flag->f.zero = !val;
 	}
+	else if constexpr (operation == CBOp::SRL)
+	{
+		flag->f.carry = val & 0x01;
+		flag->f.negative = 0;
+		flag->f.halfCarry = 0;
 
-	case 1:		// BIT
-		flag->f.zero = !((val & (0x1 << opcode.xyz.y)) >> opcode.xyz.y);
+		val >>= 1;
+		flag->f.zero = !val;
+	}
+	else if constexpr (operation == CBOp::BIT)
+	{
+		flag->f.zero = !(val & (0x1 << bit));
 		flag->f.negative = 0;
 		flag->f.halfCarry = 1;
+	}
+	else if constexpr (operation == CBOp::RES)
+	{
+		val &= ~(0x1 << bit);
+	}
+	else
+	{
+		val |= 0x1 << bit;
+	}
 
-		DBG_MSG("BIT %u, %s", opcode.xyz.y, operandNames[opcode.xyz.z]);
-		return;
-		break;
+	return val;
+}
 
-	case 2:		// RES
-		val &= ~(0x1 << opcode.xyz.y);
-		DBG_MSG("RES %x, %s", opcode.xyz.y, operandNames[opcode.xyz.z]);
-		break;
+// CB prefixed instruction on one of the registers. The opcode byte after the CB was already fetched
+template<CBOp operation, BYTE bit, BYTE reg>
+void CPU::CBRegister()
+{
+	PC.w++;							// Tick() only skipped the CB, this is the second byte
+	BYTE& target = Register8<reg>();
 
-	case 3:		// SET
-		val |= 0x1 << opcode.xyz.y;
-		DBG_MSG("SET %x, %s", opcode.xyz.y, operandNames[opcode.xyz.z]);
-		break;
+	if constexpr (operation == CBOp::BIT)
+		CBOperate<operation, bit>(target);
+	else
+		target = CBOperate<operation, bit>(target);
+
+	DBG_MSG("%s %u, %s\t", cbOperationNames[(BYTE)operation], bit, operandNames[reg]);
+}
 
+// Same thing on (HL), which costs a read and (unless it's BIT) a write
+template<CBOp operation, BYTE bit>
+void CPU::CBMemory()
+{
+	PC.w++;
+	cycles += 4;
+	BYTE val = CBOperate<operation, bit>(bus->Read(HL.w));
 
-	default:
-		EXIT_MSG("Unknown CB prefixed operation with x octal: %u", opcode.xyz.x);
-		bus->invalid = true;
-		break;
+	if constexpr (operation != CBOp::BIT)
+	{
+		cycles += 4;
+		bus->Write(HL.w, val);
 	}
 
-	WriteToRegister(opcode.xyz.z, val);
+	DBG_MSG("%s %u, (HL)\t", cbOperationNames[(BYTE)operation], bit);
 }
@@ -1,10 +1,17 @@
 #pragma once
 
 #include <array>
+#include <map>
 #include <string>
+#include <utility>
 #include "util.hpp"
+#include "jit.hpp"
+#include "trace.hpp"
+#include "profiler.hpp"
+#include "opstats.hpp"
 
 class Bus;
+class CPU;
 
 // Structure to represent a register (register = 16 bits, but split into 2 "sub registers" of 8 bits).
 // I also store the names of the regs for debug purposes
@@ -71,20 +78,111 @@ typedef union
 } Opcode;
 
 
+// The things a CB prefixed instruction can do. The first 8 are the rotates/shifts
+// in the same order as y, the rest are x = 1, 2 and 3
+enum class CBOp : BYTE
+{
+	RLC, RRC, RL, RR, SLA, SRA, SWAP, SRL,
+	BIT, RES, SET
+};
+
+// An instruction that was already fetched and decoded, so running it again doesn't have to do either.
+// The bus keeps these for every page of ROM/RAM that code runs from, see Bus::MapCode()
+struct DecodedInstruction
+{
+	void (*handler)(CPU& cpu);
+	BYTE bytes[3];			// Opcode and immediates (or the CB prefix and the actual opcode)
+	BYTE length;			// 0 if this hasn't been decoded (yet)
+	BYTE cycles;			// What fetching and decoding costs, the handler adds the rest
+	BYTE heat;				// How often a block was entered here, see JIT::Run()
+	WORD block;				// Compiled block that starts here, 0 if there is none
+};
+
+typedef std::array<DecodedInstruction, 0x100> CodePage;
+
+// What last touched the flags, if they haven't been calculated yet. See SyncFlags() in cpu.cpp
+#define FLAGS_SYNCED	0		// F is up to date
+#define FLAGS_ADD		1
+#define FLAGS_ADC		2
+#define FLAGS_SUB		3		// Also CP
+#define FLAGS_SBC		4
+#define FLAGS_AND		5
+#define FLAGS_LOGIC		6		// XOR, OR
+#define FLAGS_INC		7
+#define FLAGS_DEC		8
+
+struct LazyFlags
+{
+	BYTE op;
+	BYTE a, b;				// Operands
+	BYTE result;
+	BYTE carry;				// Carry that went into ADC/SBC, or the one INC/DEC leave alone
+};
+
+// Loops that are at most this many bytes long are checked for whether they're idling
+#define IDLE_LOOP_MAX_LENGTH 64
+
+// Keeps track of the last backwards jump, to figure out if the CPU is just spinning
+// in a loop waiting for something to happen
+struct IdleLoop
+{
+	WORD start;				// Where the jump went
+	WORD branch;			// Where the jump came from
+	WORD af, bc, de, hl, sp;
+	BYTE ime;
+	bool interrupt;			// Whether an interrupt was about to be serviced right after the jump
+	QWORD cycle;			// Bus cycle and number of bus writes when the jump happened
+	QWORD writes;
+};
+
+// Loops that do nothing but copy or fill memory. Those are run in one go instead of byte by byte, see
+// CPU::CheckBulkLoop() and Bus::RunBulkLoop()
+#define BULK_FROM_HL	0		// LD A, (HL+); LD (DE), A; INC DE
+#define BULK_FROM_DE	1		// LD A, (DE); LD (HL+), A; INC DE
+#define BULK_FROM_A		2		// LD (HL+), A or LD (HL-), A
+#define BULK_ZERO		3		// XOR A; LD (HL+), A
+
+#define BULK_COUNTER_B	0		// DEC B
+#define BULK_COUNTER_C	1		// DEC C
+#define BULK_COUNTER_BC	2		// DEC BC; LD A, B; OR C
+
+struct BulkLoop
+{
+	BYTE source;
+	BYTE counter;
+	signed char hlStep;		// What happens to HL every iteration. DE always goes up if it's used
+	WORD start, end;		// Where the loop's code is, so it doesn't overwrite itself
+	QWORD period;			// Cycles per iteration. 0 if there's nothing to run right now
+};
+
+// How often the idle loop detection kicked in for the current ROM
+struct IdleStats
+{
+	QWORD hits;
+	QWORD skippedCycles;
+	QWORD bulkLoops;				// Copy/fill loops that were run in one go
+	QWORD bulkCycles;				// and how long the CPU would've been busy with them
+	std::map<WORD, QWORD> loops;	// Hits per loop address
+};
+
 // Contains everything related to the CPU
 class CPU
 {
 public:
 	void Powerup();
-	void Tick();
+	void Tick();		// Executes the next instruction (or interrupt)
+	void SyncFlags();	// F is calculated lazily, call this before looking at it from the outside
+	inline bool CarryFlag() const;		// Just C, without calculating the rest. Compiled code needs this too
 
 	friend class Bus;
+	friend class JIT;
 
 public:
 	Interrupt interruptEnable;
 	Interrupt interruptFlag;
 
 	size_t totalCycles;
+	QWORD instructions;		// Number of instructions that were actually executed (not skipped)
 	BYTE cycles;
 
 	Register AF;	// Acc & Flags
@@ -94,11 +192,10 @@ public:
 	Register SP;		// Stack pointer
 	Register PC;		// Program counter
 	StatusFlag* flag;
+	LazyFlags lazyFlags;
 
 	Opcode opcode;
-
-	std::array<Register*, 4> rp;
-	std::array<Register*, 4> rp2;
+	WORD opcodeAddress;		// Where the current instruction started
 
 	BYTE ime;
 
@@ -107,11 +204,85 @@ public:
 	bool stopped;
 	bool halted;
 	bool justHaltedWithDI;		// I don't even know
+	bool disablePrint;			// Debug builds log every instruction unless this is set
+
+	bool idleLoopDetection;		// Whether we look for idle loops at all
+	QWORD idlePeriod;			// If the last instruction finished an idle loop, this is how many cycles one iteration takes
+	IdleStats idleStats;
+
+	JIT jit;					// Optional, the interpreter does everything the JIT doesn't
+	Trace* trace = nullptr;		// Where every instruction gets recorded, if anywhere
+	Profiler* profiler = nullptr;	// Set by Profiler::Start()
+
+#ifdef OPCODE_STATS
+	OpcodeStats opcodeStats;	// Only what went through Tick(), so no JIT, skipped idle loops, ...
+#endif
+
+private:
+	typedef void (*Handler)(CPU& cpu);
+
+	template<BYTE op> void Instruction();			// One of these for every opcode
+	template<CBOp operation, BYTE bit, BYTE reg> void CBRegister();		// And for every CB prefixed one
+	template<CBOp operation, BYTE bit> void CBMemory();
+	template<void (CPU::*handler)()> static void Forward(CPU& cpu);		// What actually goes into the tables
+
+	template<BYTE reg> void WriteR(BYTE val);		// r[reg] from the opcode decoding table
+	template<BYTE reg> BYTE ReadR();
+	template<BYTE p> Register& RP();				// rp[p] and rp2[p]
+	template<BYTE p> Register& RP2();
+	template<BYTE cc> bool Condition();				// cc[cc]
+	template<BYTE reg> BYTE& Register8();
+	BYTE Immediate();								// Next immediate operand of the current instruction
+	void Record(BYTE kind, const BYTE* bytes);		// Add an entry to the trace
+
+	template<BYTE operation> void ALU(BYTE val);	// Handle any ALU related instructions
+	template<CBOp operation, BYTE bit> BYTE CBOperate(BYTE val);
+
+	const DecodedInstruction* FetchSlow();			// Fetch & decode whatever isn't in the cache
+	void Decode(DecodedInstruction& instruction, WORD addr, WORD operandAddr);
+	static constexpr BYTE InstructionLength(BYTE op);
+
+	void DeferFlags(BYTE op, BYTE a, BYTE b, BYTE result, BYTE carry);
+	bool ZeroFlag();
+
+	template<BYTE op> static constexpr Handler CBHandler();
+
+	template<size_t... op> static constexpr std::array<Handler, sizeof...(op)> MakeHandlers(std::index_sequence<op...>);
+	template<size_t... op> static constexpr std::array<Handler, sizeof...(op)> MakeCBHandlers(std::index_sequence<op...>);
+	template<size_t... op> static constexpr std::array<BYTE, sizeof...(op)> MakeInstructionLengths(std::index_sequence<op...>);
+
+	void CheckIdleLoop(WORD branch);				// Called whenever a backwards jump is taken
+	void CheckBulkLoop(WORD branch);				// Same jump as last time, but the loop does something
 
 private:
-	void WriteToRegister(BYTE reg, BYTE val);		// The cycles, the god DAMN CPU CYCLES
-	BYTE ReadFromRegister(BYTE reg);
+	IdleLoop idleLoop;
+	BulkLoop bulkLoop;
+
+	DecodedInstruction uncached;			// For code the bus can't cache, decoded again every time
+	const BYTE* nextOperand;				// Where Immediate() reads from
 
-	void ALU(BYTE operation, BYTE operand);			// Handle any ALU related instructions
-	void CBPrefixed();								// Handle all CB prefixed instructions
+	static const std::array<Handler, 0x100> handlers;
+	static const std::array<Handler, 0x100> cbHandlers;
+	static const std::array<BYTE, 0x100> instructionLengths;
 };
+
+inline bool CPU::CarryFlag() const
+{
+	BYTE a = lazyFlags.a;
+	BYTE b = lazyFlags.b;
+	BYTE c = lazyFlags.carry;
+
+	switch (lazyFlags.op)
+	{
+	case FLAGS_ADD:		return (0xFF - b < a);
+	case FLAGS_ADC:		return (((WORD)a + b + c) & 0x100) == 0x100;
+	case FLAGS_SUB:		return (a < b);
+	case FLAGS_SBC:		return ((a - b - c) < 0);
+	case FLAGS_AND:
+	case FLAGS_LOGIC:	return false;
+	case FLAGS_INC:
+	case FLAGS_DEC:		return c;
+	}
+
+	return flag->f.carry;
+}
@@ -0,0 +1,116 @@
+#include "input.hpp"
+
+#include <string>
+
+#include "bus.hpp"
+
+bool InputScript::Parse(const char* script)
+{
+	events.clear();
+	next = 0;
+	held = 0x00;
+
+	const char* c = script;
+	while (*c)
+	{
+		// Skip whitespace, empty lines and comments
+		if (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n')
+		{
+			c++;
+			continue;
+		}
+
+		if (*c == '#')
+		{
+			while (*c && *c != '\n')
+				c++;
+
+			continue;
+		}
+
+		char* end;
+		InputEvent event;
+		event.frame = strtoull(c, &end, 10);
+		if (end == c)
+			return false;
+
+		c = end;
+		while (*c == ' ' || *c == '\t')
+			c++;
+
+		event.buttons = 0x00;
+		for (; *c && *c != '\n' && *c != '\r' && *c != ' ' && *c != '\t'; c++)
+		{
+			switch (*c)
+			{
+			case 'A':	event.buttons |= BUTTON_A;		break;
+			case 'B':	event.buttons |= BUTTON_B;		break;
+			case 'E':	event.buttons |= BUTTON_SELECT;	break;
+			case 'S':	event.buttons |= BUTTON_START;	break;
+			case 'U':	event.buttons |= BUTTON_UP;		break;
+			case 'D':	event.buttons |= BUTTON_DOWN;	break;
+			case 'L':	event.buttons |= BUTTON_LEFT;	break;
+			case 'R':	event.buttons |= BUTTON_RIGHT;	break;
+			case '-':	break;
+			default:	return false;
+			}
+		}
+
+		// Events have to be in order, otherwise playing them back is going to be weird
+		if (!events.empty() && events.back().frame > event.frame)
+			return false;
+
+		events.push_back(event);
+	}
+
+	return true;
+}
+
+bool InputScript::Load(const char* filename)
+{
+	FILE* f = fopen(filename, "rb");
+	if (f == nullptr)
+		return false;
+
+	std::string script;
+	char buffer[4096];
+	size_t read;
+	while ((read = fread(buffer, 1, sizeof(buffer), f)) > 0)
+		script.append(buffer, read);
+
+	fclose(f);
+	return Parse(script.c_str());
+}
+
+void InputScript::Apply(Bus& bus, QWORD frame)
+{
+	bool changed = false;
+	BYTE pressed = 0x00;
+	while (next < events.size() && events[next].frame <= frame)
+	{
+		pressed |= events[next].buttons & ~held;
+		held = events[next].buttons;
+		next++;
+		changed = true;
+	}
+
+	if (!changed)
+		return;
+
+	// The joypad is active low, so true means "not pressed"
+	bus.joypad.a		= !(held & BUTTON_A);
+	bus.joypad.b		= !(held & BUTTON_B);
+	bus.joypad.select	= !(held & BUTTON_SELECT);
+	bus.joypad.start	= !(held & BUTTON_START);
+	bus.joypad.right	= !(held & BUTTON_RIGHT);
+	bus.joypad.left		= !(held & BUTTON_LEFT);
+	bus.joypad.up		= !(held & BUTTON_UP);
+	bus.joypad.down		= !(held & BUTTON_DOWN);
+
+	// Same thing the window does when a key goes down
+	if (pressed)
+	{
+		bus.cpu->interruptFlag.flags.joypad = 1;
+		bus.cpu->stopped = false;
+	}
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include "util.hpp"
+
+class Bus;
+
+// Buttons in an input script
+#define BUTTON_A		0x01
+#define BUTTON_B		0x02
+#define BUTTON_SELECT	0x04
+#define BUTTON_START	0x08
+#define BUTTON_RIGHT	0x10
+#define BUTTON_LEFT		0x20
+#define BUTTON_UP		0x40
+#define BUTTON_DOWN		0x80
+
+struct InputEvent
+{
+	QWORD frame;		// Frame at which the buttons change
+	BYTE buttons;		// Buttons that are held down from that frame on
+};
+
+// A recorded sequence of joypad inputs, so we can play the same thing over and over again.
+// Scripts are plain text, one event per line:
+//
+//		# frame  buttons
+//		120      S			<- press start at frame 120
+//		126      -			<- let go of everything
+//		200      RA			<- hold right and A
+//
+// Buttons are A, B, E (sElect), S (Start), U, D, L, R, or - for nothing
+class InputScript
+{
+public:
+	bool Parse(const char* script);			// Returns false if the script is garbage
+	bool Load(const char* filename);
+
+	void Apply(Bus& bus, QWORD frame);		// Call this before running the given frame
+
+private:
+	std::vector<InputEvent> events;
+	size_t next = 0;
+	BYTE held = 0x00;
+};
@@ -0,0 +1,940 @@
+#include "jit.hpp"
+#include "aot.hpp"
+#include "bus.hpp"
+
+#include <algorithm>
+#include <initializer_list>
+#include <stddef.h>
+#include <errno.h>
+
+#ifdef JIT_SUPPORTED
+	#include <sys/mman.h>
+	#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <dlfcn.h>
+#endif
+
+/*
+	How a compiled block looks like, more or less:
+
+		for every instruction:
+			if it's not the first one, check that it starts early enough (budget)
+			if it's one of the simple ones (loads, INC/DEC, ALU, see Translate()):
+				do it right there on the registers and the lazy flags
+				memory goes through the page tables, anything else takes the slow path below
+			otherwise:
+				if it touches memory through a register, check that it's plain memory (guard)
+				tell the bus what time it is, if it's a jump
+				PC, opcodeAddress, nextOperand, cycles = what Tick() would set them to
+				call the handler, exactly the one the interpreter would've called
+
+		the slow path of a native memory access is the guard and the handler, just like above
+
+		PC and cycles of native instructions are only written when the block leaves after them
+
+	Register usage inside of a block. All of these survive calls, so the handlers leave them alone
+		rbx		CPU*
+		rbp		instructions that ran
+		r12		budget
+		r13		when the current instruction started (relative to the first one)
+		r14		BlockContext*
+		r15		when the next instruction starts
+*/
+
+// Decides whether a memory access can happen inside of a block. Gets the address for
+// instructions that have it as an immediate, the others look at the registers themselves
+typedef bool (*Guard)(CPU* cpu, WORD addr);
+
+static bool Readable(CPU* cpu, WORD addr)	{ return cpu->bus->IsPlainMemory(addr, false); }
+static bool Writable(CPU* cpu, WORD addr)	{ return cpu->bus->IsPlainMemory(addr, true); }
+
+static bool ReadHL(CPU* cpu, WORD)			{ return Readable(cpu, cpu->HL.w); }
+static bool WriteHL(CPU* cpu, WORD)			{ return Writable(cpu, cpu->HL.w); }		// Writable memory is always readable too, so this covers INC (HL) and friends
+static bool ReadBC(CPU* cpu, WORD)			{ return Readable(cpu, cpu->BC.w); }
+static bool WriteBC(CPU* cpu, WORD)			{ return Writable(cpu, cpu->BC.w); }
+static bool ReadDE(CPU* cpu, WORD)			{ return Readable(cpu, cpu->DE.w); }
+static bool WriteDE(CPU* cpu, WORD)			{ return Writable(cpu, cpu->DE.w); }
+static bool ReadC(CPU* cpu, WORD)			{ return Readable(cpu, 0xFF00 | cpu->BC.b.lo); }
+static bool WriteC(CPU* cpu, WORD)			{ return Writable(cpu, 0xFF00 | cpu->BC.b.lo); }
+static bool ReadAbs(CPU* cpu, WORD addr)	{ return Readable(cpu, addr); }
+static bool WriteAbs(CPU* cpu, WORD addr)	{ return Writable(cpu, addr); }
+static bool WriteAbs16(CPU* cpu, WORD addr)	{ return Writable(cpu, addr) && Writable(cpu, addr + 1); }
+static bool Push(CPU* cpu, WORD)			{ return Writable(cpu, cpu->SP.w - 1) && Writable(cpu, cpu->SP.w - 2); }
+static bool Pop(CPU* cpu, WORD)				{ return Readable(cpu, cpu->SP.w) && Readable(cpu, cpu->SP.w + 1); }
+
+// Same order as the GUARD_ defines
+static const Guard guards[] = {
+	nullptr,
+	ReadHL, WriteHL, ReadBC, WriteBC, ReadDE, WriteDE, ReadC, WriteC,
+	ReadAbs, WriteAbs, WriteAbs16, Push, Pop
+};
+
+// Absolute addresses are known up front. WRAM and HRAM are always fine, I/O, VRAM, OAM and the
+// MBC registers never are. Only ROM and cartridge RAM depend on what's mapped at the time
+static bool Plain(WORD addr)
+{
+	return (addr >= 0xC000 && addr < 0xFE00) || (addr >= 0xFF80 && addr < 0xFFFF);
+}
+
+static bool Never(WORD addr, bool write)
+{
+	return !Plain(addr) && ((addr >= 0x8000 && addr < 0xA000) || addr >= 0xFE00 || (write && addr < 0x8000));
+}
+
+static void Absolute(InstructionPlan& plan, WORD addr, bool write, bool wide, BYTE guard)
+{
+	WORD last = addr + (wide ? 1 : 0);
+	if (Plain(addr) && Plain(last))
+		return;
+
+	if (Never(addr, write) || Never(last, write))
+		plan.allowed = false;
+	else
+	{
+		plan.guard = guard;
+		plan.addr = addr;
+	}
+}
+
+// The instructions that make up most of any block and are simple enough to be done without the
+// handler. Those are what the JIT and the AOT recompiler turn into actual code, and all of them
+// take the same number of cycles every time
+static void Translate(InstructionPlan& plan, const BYTE* bytes)
+{
+#ifndef EAGER_FLAGS		// Translated code leaves the flags lazy, no matter what
+	BYTE op = bytes[0];
+	BYTE x = op >> 6, y = (op >> 3) & 0x7, z = op & 0x7;
+	BYTE q = y & 0x1;
+
+	plan.native = plan.allowed;
+	if (op == 0x00)							plan.cycles = 4;											// NOP
+	else if (x == 0 && z == 1 && q == 0)	plan.cycles = 12;											// LD rr, nn
+	else if (x == 0 && z == 2)				{ plan.cycles = 8; plan.access = q ? ACCESS_READ : ACCESS_WRITE; }	// LD (rr), A and LD A, (rr)
+	else if (x == 0 && z == 3)				plan.cycles = 8;											// INC/DEC rr
+	else if (x == 0 && (z == 4 || z == 5))	{ plan.cycles = (y == 6) ? 12 : 4; plan.access = (y == 6) ? ACCESS_MODIFY : ACCESS_NONE; }
+	else if (x == 0 && z == 6)				{ plan.cycles = (y == 6) ? 12 : 8; plan.access = (y == 6) ? ACCESS_WRITE : ACCESS_NONE; }
+	else if (x == 1 && op != 0x76)			{ plan.cycles = (y == 6 || z == 6) ? 8 : 4; plan.access = (y == 6) ? ACCESS_WRITE : (z == 6) ? ACCESS_READ : ACCESS_NONE; }
+	else if (x == 2)						{ plan.cycles = (z == 6) ? 8 : 4; plan.access = (z == 6) ? ACCESS_READ : ACCESS_NONE; }
+	else if (x == 3 && z == 6)				plan.cycles = 8;											// ALU n
+	else if (op == 0xEA || op == 0xFA)		{ plan.cycles = 16; plan.access = (op == 0xEA) ? ACCESS_WRITE : ACCESS_READ; }	// LD (nn), A and LD A, (nn)
+	else									plan.native = false;
+
+	if (!plan.native)
+		plan.access = ACCESS_NONE;
+#else
+	(void)plan;
+	(void)bytes;
+#endif
+}
+
+// Same decoding as in cpu.cpp, just to find out what an instruction does to the world around it
+InstructionPlan JIT::Classify(const BYTE* bytes)
+{
+	BYTE op = bytes[0];
+	BYTE x = op >> 6, y = (op >> 3) & 0x7, z = op & 0x7;
+	BYTE p = y >> 1, q = y & 0x1;
+	WORD nn = bytes[1] | (bytes[2] << 8);
+
+	InstructionPlan plan = { };
+	plan.allowed = true;
+	plan.valid = true;
+	plan.guard = GUARD_NONE;
+	plan.length = CPU::instructionLengths[op];
+	plan.access = ACCESS_NONE;
+
+	switch (x)
+	{
+	case 0:
+		if (z == 0)
+		{
+			if (y == 1)						Absolute(plan, nn, true, true, GUARD_WRITE_ABS16);		// LD (nn), SP
+			else if (y >= 2)				plan.terminal = true;								// STOP, JR
+		}
+		else if (z == 2)					// LD (BC/DE/HL+/HL-), A and the other way round
+		{
+			static const BYTE pointerGuards[2][4] = {
+				{ GUARD_WRITE_BC, GUARD_WRITE_DE, GUARD_WRITE_HL, GUARD_WRITE_HL },
+				{ GUARD_READ_BC, GUARD_READ_DE, GUARD_READ_HL, GUARD_READ_HL }
+			};
+			plan.guard = pointerGuards[q][p];
+		}
+		else if (z >= 4 && z <= 6 && y == 6)	plan.guard = GUARD_WRITE_HL;					// INC/DEC/LD (HL)
+		break;
+
+	case 1:
+		if (op == 0x76)						plan.terminal = true;								// HALT
+		else if (y == 6)					plan.guard = GUARD_WRITE_HL;
+		else if (z == 6)					plan.guard = GUARD_READ_HL;
+		break;
+
+	case 2:
+		if (z == 6)							plan.guard = GUARD_READ_HL;
+		break;
+
+	case 3:
+		switch (z)
+		{
+		case 0:
+			if (y < 4)						{ plan.guard = GUARD_POP; plan.terminal = true; }	// RET cc
+			else if (y == 4 || y == 6)		Absolute(plan, 0xFF00 | bytes[1], y == 4, false, GUARD_NONE);	// LDH, only HRAM is plain
+			break;
+
+		case 1:
+			if (q == 0)						plan.guard = GUARD_POP;								// POP
+			else if (p <= 1)				{ plan.guard = GUARD_POP; plan.terminal = true; }	// RET, RETI
+			else if (p == 2)				plan.terminal = true;								// JP HL
+			break;
+
+		case 2:
+			if (y < 4)						plan.terminal = true;								// JP cc
+			else if (y == 4)				plan.guard = GUARD_WRITE_C;
+			else if (y == 5)				Absolute(plan, nn, true, false, GUARD_WRITE_ABS);
+			else if (y == 6)				plan.guard = GUARD_READ_C;
+			else							Absolute(plan, nn, false, false, GUARD_READ_ABS);
+			break;
+
+		case 3:
+			if (y == 0 || y >= 6)			plan.terminal = true;								// JP, DI, EI
+			else if (y == 1)				// CB prefix, only (HL) touches memory
+			{
+				if ((bytes[1] & 0x7) == 6)
+					plan.guard = ((bytes[1] >> 6) == 1) ? GUARD_READ_HL : GUARD_WRITE_HL;
+			}
+			else							plan.valid = false;
+			break;
+
+		case 4:
+			if (y < 4)						{ plan.guard = GUARD_PUSH; plan.terminal = true; }	// CALL cc
+			else							plan.valid = false;
+			break;
+
+		case 5:
+			if (q == 0)						plan.guard = GUARD_PUSH;							// PUSH
+			else if (p == 0)				{ plan.guard = GUARD_PUSH; plan.terminal = true; }	// CALL
+			else							plan.valid = false;
+			break;
+
+		case 7:								{ plan.guard = GUARD_PUSH; plan.terminal = true; }	// RST
+			break;
+		}
+		break;
+	}
+
+	plan.allowed = plan.allowed && plan.valid;
+	Translate(plan, bytes);
+	return plan;
+}
+
+bool JIT::Guard(CPU* cpu, BYTE guard, WORD addr)
+{
+	return guards[guard](cpu, addr);
+}
+
+BYTE JIT::Execute(CPU* cpu, WORD addr, const BYTE* bytes)
+{
+	// Same as what Tick() and Decode() would do
+	cpu->opcodeAddress = addr;
+	cpu->PC.w = addr + 1;
+	cpu->nextOperand = bytes + 1;
+
+	if (bytes[0] == 0xCB)
+	{
+		cpu->cycles = 12;
+		CPU::cbHandlers[bytes[1]](*cpu);
+	}
+	else
+	{
+		cpu->cycles = 4;
+		CPU::handlers[bytes[0]](*cpu);
+	}
+
+	return cpu->cycles;
+}
+
+// Just enough of an assembler for what blocks need. Registers are numbered like in the ModRM byte,
+// so 0 is eax/al, 1 is ecx/cl and 2 is edx/dl. Fields of the CPU are addressed relative to rbx
+class Emitter
+{
+public:
+	void Bytes(std::initializer_list<BYTE> bytes)	{ code.insert(code.end(), bytes); }
+	void Word(WORD val)		{ Bytes({ (BYTE)val, (BYTE)(val >> 8) }); }
+	void DWord(DWORD val)	{ Word((WORD)val); Word((WORD)(val >> 16)); }
+	void QWord(QWORD val)	{ DWord((DWORD)val); DWord((DWORD)(val >> 32)); }
+
+	void Field(BYTE reg, DWORD offset)			{ Bytes({ (BYTE)(0x83 | (reg << 3)) }); DWord(offset); }		// [rbx + offset]
+	void LoadByte(BYTE reg, DWORD offset)		{ Bytes({ 0x0F, 0xB6 }); Field(reg, offset); }		// movzx reg, byte [rbx + offset]
+	void LoadWord(BYTE reg, DWORD offset)		{ Bytes({ 0x0F, 0xB7 }); Field(reg, offset); }		// movzx reg, word [rbx + offset]
+	void StoreByte(BYTE reg, DWORD offset)		{ Bytes({ 0x88 }); Field(reg, offset); }			// mov [rbx + offset], reg
+	void StoreByte(DWORD offset, BYTE val)		{ Bytes({ 0xC6 }); Field(0, offset); Bytes({ val }); }
+	void StoreWord(DWORD offset, WORD val)		{ Bytes({ 0x66, 0xC7 }); Field(0, offset); Word(val); }
+	void AddWord(DWORD offset, bool subtract)	{ Bytes({ 0x66, 0xFF }); Field(subtract ? 1 : 0, offset); }	// inc/dec word [rbx + offset]
+
+	// Jumps anywhere in the block. Labels get their place with Bind(), and the jumps are filled in once all of them have one
+	size_t Label()
+	{
+		labels.push_back(0);
+		return labels.size() - 1;
+	}
+
+	void Bind(size_t label)
+	{
+		labels[label] = code.size();
+	}
+
+	void Jump(std::initializer_list<BYTE> opcode, size_t label)
+	{
+		Bytes(opcode);
+		jumps.push_back({ code.size(), label });
+		DWord(0);
+	}
+
+	void PatchJumps()
+	{
+		for (const auto& [at, label] : jumps)
+		{
+			DWORD rel = (DWORD)(labels[label] - (at + 4));
+			for (int i = 0; i < 4; i++)
+				code[at + i] = (BYTE)(rel >> (i * 8));
+		}
+	}
+
+	void Call(const void* function)
+	{
+		Bytes({ 0x48, 0x89, 0xDF });						// mov rdi, rbx
+		Bytes({ 0x48, 0xB8 }); QWord((QWORD)function);		// mov rax, function
+		Bytes({ 0xFF, 0xD0 });								// call rax
+	}
+
+public:
+	std::vector<BYTE> code;
+	std::vector<size_t> labels;
+	std::vector<std::pair<size_t, size_t>> jumps;		// Where the displacement is, and where it should go
+};
+
+// For modules, they can't call into the bus themselves
+static BYTE ReadByte(CPU* cpu, WORD addr)
+{
+	return cpu->bus->Read(addr);
+}
+
+static void WriteByte(CPU* cpu, WORD addr, BYTE val)
+{
+	cpu->bus->Write(addr, val);
+}
+
+#ifdef JIT_SUPPORTED
+// For translated code that needs the carry, but doesn't know what touched the flags last
+static BYTE CarryOf(CPU* cpu)
+{
+	return cpu->CarryFlag();
+}
+#endif
+
+JIT::JIT()
+{
+	blocks.push_back({ nullptr, 0, nullptr });
+}
+
+JIT::~JIT()
+{
+#ifdef JIT_SUPPORTED
+	if (arena != nullptr)
+		munmap(arena, JIT_ARENA_SIZE);
+#endif
+
+	if (module != nullptr)
+	{
+#ifdef _WIN32
+		FreeLibrary((HMODULE)module);
+#else
+		dlclose(module);
+#endif
+	}
+}
+
+void JIT::Reset(CPU& c)
+{
+	cpu = &c;
+	Flush();
+}
+
+void JIT::Flush()
+{
+	for (size_t i = 1; i < blocks.size(); i++)
+	{
+		blocks[i].owner->block = 0;
+		blocks[i].owner->heat = 0;
+	}
+
+	blocks.resize(1);
+	arenaUsed = 0;
+}
+
+bool JIT::Run(QWORD cycle, QWORD& ran)
+{
+	// Only ROM (and the boot ROM) gets compiled, RAM code could change under our feet. Blocks
+	// don't show up in the trace either, so nothing runs in them while that's on
+	if ((!enabled && precompiled.empty()) || cpu->PC.w >= 0x8000 || cpu->justHaltedWithDI || cpu->trace != nullptr)
+		return false;
+
+#ifdef OPCODE_STATS
+	return false;		// Same for the opcode counts, those only come from Tick()
+#endif
+
+	Bus* bus = cpu->bus;
+	CodePage* code = bus->codePages[cpu->PC.w >> 8];
+	if (code == nullptr)
+		return false;
+
+	DecodedInstruction& first = (*code)[cpu->PC.w & 0xFF];
+	if (first.block == 0)
+	{
+		if (first.length == 0 || first.heat == JIT_NEVER)
+			return false;
+
+		// Blocks that were compiled ahead of time are there right away, but only worth looking for once
+		bool found = (first.heat == 0 && Precompiled(first, cpu->PC.w));
+		if (!found && !enabled)
+		{
+			first.heat = JIT_NEVER;
+			return false;
+		}
+
+		if (!found && ++first.heat < JIT_HOT_THRESHOLD)
+			return false;
+
+		if (!found && !Compile(first, cpu->PC.w))
+		{
+			first.heat = JIT_NEVER;
+			return false;
+		}
+	}
+
+	const Block& block = blocks[first.block];
+	if (block.address != cpu->PC.w)
+		return false;
+
+	// Every instruction after the first has to start before the bus wants to stop, and before anything
+	// else happens. That way nobody can notice that the interpreter loop didn't run in between
+	QWORD now = bus->internalCounter;
+	QWORD limit = std::min(cycle, bus->scheduler.Next()) - 1;
+	BlockContext context = { limit - now, 0, now, &bus->internalCounter };
+
+	DWORD count = block.code(cpu, &context);
+	if (count == 0)			// The very first instruction wanted to touch something it shouldn't
+		return false;
+
+	// The interpreter would've counted one cycle per Tick() and all the cycles of all but the last instruction
+	bus->internalCounter = now + context.last;
+	cpu->totalCycles += context.last + 1;
+	cpu->instructions += count;
+	blockInstructions += count;
+
+	ran = context.last;
+	return true;
+}
+
+bool JIT::Precompiled(DecodedInstruction& first, WORD address)
+{
+	if (precompiled.empty())
+		return false;
+
+	// The module knows its blocks by where they are in the ROM file, which depends on the bank
+	const std::vector<BYTE>& data = cpu->bus->rom->Data();
+	const BYTE* page = cpu->bus->readPages[address >> 8];
+	if (page < data.data() || page >= data.data() + data.size())
+		return false;		// Boot ROM
+
+	QWORD offset = (QWORD)(page - data.data()) + (address & 0xFF);
+	auto it = precompiled.find((offset << 16) | address);
+	if (it == precompiled.end() || blocks.size() > 0xFFFF)
+		return false;
+
+	first.block = (WORD)blocks.size();
+	blocks.push_back({ it->second, address, &first });
+	precompiledBlocks++;
+	return true;
+}
+
+bool JIT::LoadModule(const char* filename)
+{
+	static const AOTRuntime runtime = { AOT_VERSION, JIT::Guard, JIT::Execute, ReadByte, WriteByte };
+
+#ifdef _WIN32
+	HMODULE handle = LoadLibraryA(filename);
+	AOTEntry entry = (handle != nullptr) ? (AOTEntry)GetProcAddress(handle, AOT_ENTRY) : nullptr;
+#else
+	void* handle = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
+	AOTEntry entry = (handle != nullptr) ? (AOTEntry)dlsym(handle, AOT_ENTRY) : nullptr;
+#endif
+
+	if (entry == nullptr)
+	{
+#ifndef _WIN32
+		fprintf(stderr, "%s\n", (handle != nullptr) ? "Not a yabgbe module" : dlerror());
+#endif
+		return false;
+	}
+
+	const AOTModule* aot = entry(&runtime);
+	if (aot == nullptr || aot->version != AOT_VERSION || aot->romHash != cpu->bus->rom->Hash())
+	{
+		fprintf(stderr, "%s was made for a different ROM or a different version of the emulator\n", filename);
+#ifdef _WIN32
+		FreeLibrary(handle);
+#else
+		dlclose(handle);
+#endif
+		return false;
+	}
+
+	for (DWORD i = 0; i < aot->count; i++)
+		precompiled[((QWORD)aot->blocks[i].offset << 16) | aot->blocks[i].address] = aot->blocks[i].code;
+
+	module = (void*)handle;
+	return true;
+}
+
+bool JIT::Compile(DecodedInstruction& first, WORD address)
+{
+#ifdef JIT_SUPPORTED
+	struct Step
+	{
+		DecodedInstruction* instruction;
+		WORD addr;
+		InstructionPlan plan;
+	};
+
+	// Find the block. It ends at the end of the page, since the next one might be a different bank
+	CodePage& page = *cpu->bus->codePages[address >> 8];
+	std::vector<Step> steps;
+	for (WORD addr = address; steps.size() < JIT_MAX_INSTRUCTIONS && (addr >> 8) == (address >> 8); )
+	{
+		DecodedInstruction& instruction = page[addr & 0xFF];
+		if (instruction.length == 0)
+		{
+			if ((addr & 0xFF) + cpu->instructionLengths[cpu->bus->Read(addr)] > 0x100)
+				break;
+
+			cpu->Decode(instruction, addr, addr + 1);
+		}
+
+		InstructionPlan plan = Classify(instruction.bytes);
+		if (!plan.allowed)
+			break;
+
+		steps.push_back({ &instruction, addr, plan });
+		addr += instruction.length;
+		if (plan.terminal)
+			break;
+	}
+
+	if (steps.empty() || blocks.size() > 0xFFFF)
+		return false;
+
+	// Where the things that Tick() would set live, and everything translated code works with
+	Bus* bus = cpu->bus;
+	BYTE* base = (BYTE*)cpu;
+	auto offset = [base](const void* field) { return (DWORD)((const BYTE*)field - base); };
+
+	DWORD pcOffset = offset(&cpu->PC.w);
+	DWORD opcodeAddressOffset = offset(&cpu->opcodeAddress);
+	DWORD nextOperandOffset = offset(&cpu->nextOperand);
+	DWORD cyclesOffset = offset(&cpu->cycles);
+	DWORD flagsOp = offset(&cpu->lazyFlags.op);
+	DWORD flagsA = offset(&cpu->lazyFlags.a);
+	DWORD flagsB = offset(&cpu->lazyFlags.b);
+	DWORD flagsResult = offset(&cpu->lazyFlags.result);
+	DWORD flagsCarry = offset(&cpu->lazyFlags.carry);
+	const DWORD r[8] = {
+		offset(&cpu->BC.b.hi), offset(&cpu->BC.b.lo), offset(&cpu->DE.b.hi), offset(&cpu->DE.b.lo),
+		offset(&cpu->HL.b.hi), offset(&cpu->HL.b.lo), 0, offset(&cpu->AF.b.hi)
+	};
+	const DWORD rp[4] = { offset(&cpu->BC.w), offset(&cpu->DE.w), offset(&cpu->HL.w), offset(&cpu->SP.w) };
+
+	Emitter e;
+	e.Bytes({ 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 });	// push rbx, rbp, r12, r13, r14, r15
+	e.Bytes({ 0x48, 0x83, 0xEC, 0x08 });							// sub rsp, 8 (calls want the stack 16 byte aligned, and [rsp] is scratch space)
+	e.Bytes({ 0x48, 0x89, 0xFB });									// mov rbx, rdi
+	e.Bytes({ 0x49, 0x89, 0xF6 });									// mov r14, rsi
+	e.Bytes({ 0x4D, 0x8B, 0x66, offsetof(BlockContext, budget) });	// mov r12, [r14 + budget]
+	e.Bytes({ 0x45, 0x31, 0xED });									// xor r13d, r13d
+	e.Bytes({ 0x31, 0xED });										// xor ebp, ebp
+
+	size_t epilogue = e.Label();
+	std::vector<size_t> exitAfter, slow, done;		// Per instruction: leave after it ran, go through the handler, back from there
+	for (size_t i = 0; i < steps.size(); i++)
+	{
+		exitAfter.push_back(e.Label());
+		slow.push_back(e.Label());
+		done.push_back(e.Label());
+	}
+
+	// Exactly what the interpreter would do, minus the fetch
+	auto callHandler = [&](const Step& step)
+	{
+		e.StoreWord(pcOffset, step.addr + 1);
+		e.StoreWord(opcodeAddressOffset, step.addr);
+		e.Bytes({ 0x48, 0xB8 }); e.QWord((QWORD)(step.instruction->bytes + 1));		// mov rax, operands
+		e.Bytes({ 0x48, 0x89, 0x83 }); e.DWord(nextOperandOffset);						// mov [rbx + nextOperand], rax
+		e.StoreByte(cyclesOffset, step.instruction->cycles);
+		e.Call((const void*)step.instruction->handler);
+	};
+
+	// Translated instructions don't bother with PC and the cycles, that's only done once we leave
+	auto leave = [&](size_t i)
+	{
+		const Step& step = steps[i];
+		if (step.plan.native)
+		{
+			e.StoreWord(pcOffset, step.addr + step.plan.length);
+			e.StoreByte(cyclesOffset, step.plan.cycles);
+		}
+
+		e.Bytes({ 0xBD }); e.DWord((DWORD)i + 1);				// mov ebp, instructions that ran
+	};
+
+	auto countWrite = [&]()
+	{
+		e.Bytes({ 0x48, 0xB9 }); e.QWord((QWORD)&bus->writes);	// mov rcx, &writes
+		e.Bytes({ 0x48, 0xFF, 0x01 });							// inc qword [rcx]
+	};
+
+	// The operand of an 8 bit instruction goes into cl and comes back out of it. (HL) is at rdx by then
+	auto loadOperand = [&](BYTE reg)
+	{
+		if (reg == 6)	e.Bytes({ 0x0F, 0xB6, 0x0A });			// movzx ecx, byte [rdx]
+		else			e.LoadByte(1, r[reg]);
+	};
+
+	auto storeOperand = [&](BYTE reg)
+	{
+		if (reg == 6)
+		{
+			e.Bytes({ 0x88, 0x0A });							// mov [rdx], cl
+			countWrite();
+		}
+		else
+			e.StoreByte(1, r[reg]);
+	};
+
+	// What touched the flags last, as far as we know. Translated code only needs to call
+	// CarryFlag() if it was something outside of the block (or a handler)
+	const BYTE unknown = 0xFF;
+	BYTE flags = unknown;
+
+	for (size_t i = 0; i < steps.size(); i++)
+	{
+		const Step& step = steps[i];
+		const InstructionPlan& plan = step.plan;
+		size_t bail = (i > 0) ? exitAfter[i - 1] : epilogue;
+
+		if (i > 0)
+		{
+			// The next instruction starts one cycle after the last one is done
+			if (steps[i - 1].plan.native)
+				e.Bytes({ 0x4D, 0x8D, 0x7D, (BYTE)(steps[i - 1].plan.cycles + 1) });	// lea r15, [r13 + cycles + 1]
+			else
+			{
+				e.LoadByte(0, cyclesOffset);						// movzx eax, byte [rbx + cycles]
+				e.Bytes({ 0x4D, 0x8D, 0x7C, 0x05, 0x01 });			// lea r15, [r13 + rax + 1]
+			}
+
+			e.Bytes({ 0x4D, 0x39, 0xE7 });							// cmp r15, r12
+			e.Jump({ 0x0F, 0x87 }, bail);							// ja bail
+		}
+
+		if (!plan.native)
+		{
+			if (plan.guard != GUARD_NONE)
+			{
+				e.Bytes({ 0xBE }); e.DWord(plan.addr);				// mov esi, addr
+				e.Call((const void*)guards[plan.guard]);
+				e.Bytes({ 0x84, 0xC0 });							// test al, al
+				e.Jump({ 0x0F, 0x84 }, bail);						// jz bail
+			}
+
+			if (i > 0)
+				e.Bytes({ 0x4D, 0x89, 0xFD });						// mov r13, r15
+
+			// Jumps want to know the time for the idle loop detection, nothing else in a block can look at it
+			if (plan.terminal)
+			{
+				e.Bytes({ 0x49, 0x8B, 0x46, offsetof(BlockContext, start) });	// mov rax, [r14 + start]
+				e.Bytes({ 0x4C, 0x01, 0xE8 });									// add rax, r13
+				e.Bytes({ 0x49, 0x8B, 0x4E, offsetof(BlockContext, counter) });	// mov rcx, [r14 + counter]
+				e.Bytes({ 0x48, 0x89, 0x01 });									// mov [rcx], rax
+			}
+
+			callHandler(step);
+			flags = unknown;
+			continue;
+		}
+
+		const BYTE* bytes = step.instruction->bytes;
+		BYTE op = bytes[0];
+		BYTE x = op >> 6, y = (op >> 3) & 0x7, z = op & 0x7;
+		BYTE p = y >> 1, q = y & 0x1;
+		bool alu = (x == 2 || (x == 3 && z == 6));
+		bool incDec = (x == 0 && (z == 4 || z == 5));
+		bool carryIn = alu && (y == 1 || y == 3);		// ADC, SBC
+
+		// The carry from before goes on the stack, since anything after this might need eax, ecx and edx. After
+		// INC and DEC it's already where it needs to be, they're only going to copy it over anyways
+		bool keepCarry = incDec && (flags == FLAGS_INC || flags == FLAGS_DEC);
+		if ((carryIn || incDec) && !keepCarry)
+		{
+			switch (flags)
+			{
+			case FLAGS_ADD:
+				e.LoadByte(0, flagsA);
+				e.LoadByte(1, flagsB);
+				e.Bytes({ 0x01, 0xC8 });							// add eax, ecx
+				e.Bytes({ 0xC1, 0xE8, 0x08 });						// shr eax, 8
+				break;
+
+			case FLAGS_SUB:
+				e.LoadByte(0, flagsA);
+				e.LoadByte(1, flagsB);
+				e.Bytes({ 0x39, 0xC8 });							// cmp eax, ecx
+				e.Bytes({ 0x0F, 0x92, 0xC0 });						// setb al
+				break;
+
+			case FLAGS_AND:
+			case FLAGS_LOGIC:
+				e.Bytes({ 0x31, 0xC0 });							// xor eax, eax
+				break;
+
+			default:
+				e.Call((const void*)CarryOf);
+				break;
+			}
+
+			e.Bytes({ 0x88, 0x04, 0x24 });							// mov [rsp], al
+		}
+
+		// Plain memory has a page in the tables, so finding it there is all the guard we need. Everything else goes
+		// through the guard and the handler, which might still be fine for WRAM with code in it, or HRAM
+		if (plan.access != ACCESS_NONE)
+		{
+			if (op == 0xEA || op == 0xFA)
+			{
+				e.Bytes({ 0xB9 }); e.DWord(bytes[1] | (bytes[2] << 8));		// mov ecx, nn
+			}
+			else
+				e.LoadWord(1, rp[(x == 0 && z == 2) ? std::min<BYTE>(p, 2) : 2]);	// movzx ecx, BC/DE/HL
+
+			const BYTE* const* table = (plan.access == ACCESS_READ) ? bus->readPages.data() : bus->writePages.data();
+			e.Bytes({ 0x89, 0xC8 });								// mov eax, ecx
+			e.Bytes({ 0xC1, 0xE8, 0x08 });							// shr eax, 8
+			e.Bytes({ 0x48, 0xBA }); e.QWord((QWORD)table);		// mov rdx, table
+			e.Bytes({ 0x48, 0x8B, 0x14, 0xC2 });					// mov rdx, [rdx + rax * 8]
+			e.Bytes({ 0x48, 0x85, 0xD2 });							// test rdx, rdx
+			e.Jump({ 0x0F, 0x84 }, slow[i]);						// jz slow
+			e.Bytes({ 0x0F, 0xB6, 0xC9 });							// movzx ecx, cl
+			e.Bytes({ 0x48, 0x01, 0xCA });							// add rdx, rcx
+		}
+
+		if (i > 0)
+			e.Bytes({ 0x4D, 0x89, 0xFD });							// mov r13, r15
+
+		if (op == 0x00)												// NOP
+		{
+		}
+		else if (x == 0 && z == 1)									// LD rr, nn
+			e.StoreWord(rp[p], bytes[1] | (bytes[2] << 8));
+		else if (x == 0 && z == 2)									// LD (rr), A and LD A, (rr)
+		{
+			if (q == 0)
+			{
+				e.LoadByte(1, r[7]);
+				e.Bytes({ 0x88, 0x0A });							// mov [rdx], cl
+				countWrite();
+			}
+			else
+			{
+				e.Bytes({ 0x0F, 0xB6, 0x0A });						// movzx ecx, byte [rdx]
+				e.StoreByte(1, r[7]);
+			}
+
+			if (p >= 2)
+				e.AddWord(rp[2], p == 3);							// HL+, HL-
+		}
+		else if (x == 0 && z == 3)									// INC/DEC rr
+			e.AddWord(rp[p], q == 1);
+		else if (incDec)
+		{
+			loadOperand(y);
+			if (!keepCarry)
+			{
+				e.Bytes({ 0x0F, 0xB6, 0x04, 0x24 });				// movzx eax, byte [rsp]
+				e.StoreByte(0, flagsCarry);
+			}
+
+			flags = (z == 4) ? FLAGS_INC : FLAGS_DEC;
+			e.StoreByte(flagsOp, flags);
+			e.StoreByte(1, flagsA);
+			e.StoreByte(flagsB, 1);
+			e.Bytes({ 0xFE, (BYTE)((z == 4) ? 0xC1 : 0xC9) });		// inc cl / dec cl
+			e.StoreByte(1, flagsResult);
+			storeOperand(y);
+		}
+		else if (x == 0 && z == 6)									// LD r, n
+		{
+			if (y == 6)
+			{
+				e.Bytes({ 0xC6, 0x02, bytes[1] });					// mov byte [rdx], n
+				countWrite();
+			}
+			else
+				e.StoreByte(r[y], bytes[1]);
+		}
+		else if (x == 1)											// LD r, r
+		{
+			loadOperand(z);
+			storeOperand(y);
+		}
+		else if (alu)
+		{
+			static const BYTE operations[8] = { 0x00, 0x00, 0x28, 0x28, 0x20, 0x30, 0x08, 0x28 };	// add, add, sub, sub, and, xor, or, sub dl, cl
+			static const BYTE results[8] = { FLAGS_ADD, FLAGS_ADC, FLAGS_SUB, FLAGS_SBC, FLAGS_AND, FLAGS_LOGIC, FLAGS_LOGIC, FLAGS_SUB };
+
+			if (x == 2)
+				loadOperand(z);
+			else
+			{
+				e.Bytes({ 0xB9 }); e.DWord(bytes[1]);				// mov ecx, n
+			}
+
+			e.LoadByte(0, r[7]);
+			e.Bytes({ 0x89, 0xC2 });								// mov edx, eax
+			e.Bytes({ operations[y], 0xCA });						// op dl, cl
+			if (y == 1)
+				e.Bytes({ 0x02, 0x14, 0x24 });						// add dl, [rsp]
+			else if (y == 3)
+				e.Bytes({ 0x2A, 0x14, 0x24 });						// sub dl, [rsp]
+
+			flags = results[y];
+			e.StoreByte(flagsOp, flags);
+			e.StoreByte(0, flagsA);
+			e.StoreByte(1, flagsB);
+			e.StoreByte(2, flagsResult);
+			if (carryIn)
+			{
+				e.Bytes({ 0x0F, 0xB6, 0x04, 0x24 });				// movzx eax, byte [rsp]
+				e.StoreByte(0, flagsCarry);
+			}
+			else
+				e.StoreByte(flagsCarry, 0);
+
+			if (y != 7)												// CP forgets the result
+				e.StoreByte(2, r[7]);
+		}
+		else if (op == 0xEA)										// LD (nn), A
+		{
+			e.LoadByte(1, r[7]);
+			e.Bytes({ 0x88, 0x0A });								// mov [rdx], cl
+			countWrite();
+		}
+		else														// LD A, (nn)
+		{
+			e.Bytes({ 0x0F, 0xB6, 0x0A });							// movzx ecx, byte [rdx]
+			e.StoreByte(1, r[7]);
+		}
+
+		e.Bind(done[i]);
+	}
+
+	// Everything ran
+	leave(steps.size() - 1);
+	e.Bind(epilogue);
+	e.Bytes({ 0x4D, 0x89, 0x6E, offsetof(BlockContext, last) });	// mov [r14 + last], r13
+	e.Bytes({ 0x89, 0xE8 });										// mov eax, ebp
+	e.Bytes({ 0x48, 0x83, 0xC4, 0x08 });							// add rsp, 8
+	e.Bytes({ 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B });	// pop r15, r14, r13, r12, rbp, rbx
+	e.Bytes({ 0xC3 });												// ret
+
+	// The ways out of the middle of the block, out of the way of the code that actually runs
+	for (size_t i = 0; i + 1 < steps.size(); i++)
+	{
+		e.Bind(exitAfter[i]);
+		leave(i);
+		e.Jump({ 0xE9 }, epilogue);								// jmp epilogue
+	}
+
+	// Same for memory that isn't in the page tables. That's up to the guard and the handler
+	for (size_t i = 0; i < steps.size(); i++)
+	{
+		const Step& step = steps[i];
+		if (step.plan.access == ACCESS_NONE)
+			continue;
+
+		e.Bind(slow[i]);
+		if (step.plan.guard != GUARD_NONE)
+		{
+			e.Bytes({ 0xBE }); e.DWord(step.plan.addr);			// mov esi, addr
+			e.Call((const void*)guards[step.plan.guard]);
+			e.Bytes({ 0x84, 0xC0 });								// test al, al
+			e.Jump({ 0x0F, 0x84 }, (i > 0) ? exitAfter[i - 1] : epilogue);	// jz bail
+		}
+
+		if (i > 0)
+			e.Bytes({ 0x4D, 0x89, 0xFD });							// mov r13, r15
+
+		callHandler(step);
+		e.Jump({ 0xE9 }, done[i]);								// jmp done
+	}
+
+	e.PatchJumps();
+
+	// Put it somewhere it can run. If we're out of space just start over, whatever was hot will be again soon
+	if (arena == nullptr)
+	{
+		void* memory = mmap(nullptr, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED)
+		{
+			EXIT_MSG("Failed to allocate %d bytes for the JIT, sticking to the interpreter", JIT_ARENA_SIZE);
+			enabled = false;
+			return false;
+		}
+
+		arena = (BYTE*)memory;
+	}
+
+	if (arenaUsed + e.code.size() > JIT_ARENA_SIZE)
+		Flush();
+
+	// Only the pages the new block lands on have to be writable for a moment, everything else stays as it is
+	static const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	size_t from = arenaUsed & ~(pageSize - 1);
+	size_t to = (arenaUsed + e.code.size() + pageSize - 1) & ~(pageSize - 1);
+	if (mprotect(arena + from, to - from, PROT_READ | PROT_WRITE) != 0)
+	{
+		enabled = false;
+		return false;
+	}
+
+	BYTE* target = arena + arenaUsed;
+	memcpy(target, e.code.data(), e.code.size());
+	arenaUsed += (e.code.size() + 0xF) & ~(size_t)0xF;
+
+	if (mprotect(arena + from, to - from, PROT_READ | PROT_EXEC) != 0)
+	{
+		enabled = false;
+		return false;
+	}
+
+	first.block = (WORD)blocks.size();
+	blocks.push_back({ (BlockCode)target, address, &first });
+	compiledBlocks++;
+	return true;
+#else
+	(void)first;
+	(void)address;
+	return false;
+#endif
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+#include "util.hpp"
+
+class CPU;
+struct DecodedInstruction;
+
+// The code that comes out of this is x86-64 for the System V calling convention (so Linux and
+// macOS, not Windows). Everywhere else nothing ever gets compiled and the interpreter does it all
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(_WIN32)
+	#define JIT_SUPPORTED
+#endif
+
+#define JIT_HOT_THRESHOLD		16						// How often a block has to be entered before it's worth compiling
+#define JIT_NEVER				0xFF					// Heat of a block that can't be compiled at all
+#define JIT_MAX_INSTRUCTIONS	64
+#define JIT_ARENA_SIZE			(4 * 1024 * 1024)		// Once this is full everything gets thrown away and we start over
+
+// Memory an instruction touches that has to be checked before it can run in a block. See JIT::Classify()
+#define GUARD_NONE			0
+#define GUARD_READ_HL		1
+#define GUARD_WRITE_HL		2
+#define GUARD_READ_BC		3
+#define GUARD_WRITE_BC		4
+#define GUARD_READ_DE		5
+#define GUARD_WRITE_DE		6
+#define GUARD_READ_C		7		// (C), so $FF00 + C
+#define GUARD_WRITE_C		8
+#define GUARD_READ_ABS		9		// (nn), the address is passed along
+#define GUARD_WRITE_ABS		10
+#define GUARD_WRITE_ABS16	11
+#define GUARD_PUSH			12		// Anything that pushes, including CALL and RST
+#define GUARD_POP			13		// Anything that pops, including RET
+
+// How an instruction that gets translated touches memory. The address is in BC, DE, HL or the immediate
+#define ACCESS_NONE			0
+#define ACCESS_READ			1
+#define ACCESS_WRITE		2
+#define ACCESS_MODIFY		3		// INC/DEC (HL), read and write back
+
+// What compiling an instruction needs to know about it
+struct InstructionPlan
+{
+	bool allowed;			// false if the block has to end before it
+	bool valid;				// false for the opcodes that don't exist
+	bool terminal;			// true if the block has to end after it (jumps, interrupt stuff, HALT, ...)
+	BYTE guard;
+	WORD addr;				// For the guard
+	BYTE length;
+
+	bool native;			// Loads, INC/DEC and the ALU get translated, everything else calls the handler
+	BYTE cycles;			// All of them, only known up front for the translated ones
+	BYTE access;
+};
+
+// What compiled code gets handed, and what it hands back
+struct BlockContext
+{
+	QWORD budget;			// How many cycles after the first instruction the last one may start
+	QWORD last;				// When the last instruction that actually ran started (relative to the first one)
+	QWORD start;			// Bus cycle the first instruction started at
+	QWORD* counter;			// The bus' master clock, kept up to date for the handlers that look at it (jumps)
+};
+
+typedef DWORD (*BlockCode)(CPU* cpu, BlockContext* context);		// Returns how many instructions it ran
+
+struct Block
+{
+	BlockCode code;
+	WORD address;					// Where it was compiled for. The same bank might show up at another address too
+	DecodedInstruction* owner;		// The instruction it starts at, which points back to this
+};
+
+// Turns straight runs of ROM code into native code. Loads, INC/DEC and the ALU ops are translated
+// for real, everything else calls the instruction handlers one after another, without going through
+// the bus and the fetch for every single one of them. Blocks never
+// touch I/O, never switch banks and never write to code (ROM can't be written to, and RAM code isn't
+// compiled at all). Instructions that could do any of that by looking at registers check first and
+// hand the rest of the block back to the interpreter if they would. So would running into the next
+// scheduled event
+class JIT
+{
+public:
+	JIT();
+	~JIT();
+
+	JIT(const JIT&) = delete;
+	JIT& operator=(const JIT&) = delete;
+
+	void Reset(CPU& cpu);		// Throw away everything that was compiled, the CPU starts over
+	void Flush();				// Same, but the CPU keeps going (or the ROM went away)
+
+	// Runs the block at PC, if there is one and it's hot. ran is how many cycles after now the last
+	// instruction of it started. Returns false if nothing ran, then it's up to the interpreter
+	bool Run(QWORD cycle, QWORD& ran);
+
+	// Blocks that were recompiled ahead of time (see aot.cpp). Those work without the JIT being
+	// enabled, and on any platform. Has to be loaded after the ROM was inserted
+	bool LoadModule(const char* filename);
+
+	// Also used by the AOT recompiler, and by what it generates
+	static InstructionPlan Classify(const BYTE* bytes);
+	static bool Guard(CPU* cpu, BYTE guard, WORD addr);
+	static BYTE Execute(CPU* cpu, WORD addr, const BYTE* bytes);		// Runs one instruction like Tick() would, returns its cycles
+
+public:
+	bool enabled = false;		// Off unless someone asks for it
+	QWORD compiledBlocks = 0;
+	QWORD blockInstructions = 0;	// Instructions that ran inside of blocks
+	QWORD precompiledBlocks = 0;	// Blocks that came from the AOT module
+
+private:
+	bool Compile(DecodedInstruction& first, WORD address);
+	bool Precompiled(DecodedInstruction& first, WORD address);
+
+private:
+	CPU* cpu = nullptr;
+	std::vector<Block> blocks;		// blocks[0] is a dummy, because 0 means "no block" in the decoded instructions
+
+	BYTE* arena = nullptr;			// Executable memory. Only ever writable or executable, never both
+	size_t arenaUsed = 0;
+
+	void* module = nullptr;			// The AOT module, if there is one
+	std::unordered_map<QWORD, BlockCode> precompiled;		// By ROM offset << 16 | address
+};
@@ -0,0 +1,160 @@
+#include "bus.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <string.h>
+
+// Runs a ROM twice side by side, once with the JIT and once with just the interpreter, and
+// complains as soon as the two disagree on anything. Both are cycle exact, so they have to
+// agree on everything all the time, not just at the end of a frame
+
+struct Options
+{
+	const char* rom = nullptr;
+	QWORD frames = 1500;
+	QWORD step = 456;		// Cycles in between comparisons. One scanline by default
+	const char* module = nullptr;	// AOT module for the JIT side, if there is one
+};
+
+// Everything one emulation needs
+struct Machine
+{
+	Bus bus;
+	CPU cpu;
+	LCD lcd;
+	std::unique_ptr<ROM> rom;
+
+	bool Load(const char* filename, bool jit, const char* module)
+	{
+		FILE* f = fopen(filename, "rb");
+		if (f == nullptr)
+			return false;
+
+		bus.AttachCPU(cpu);
+		bus.AttachLCD(lcd);
+
+		rom = std::make_unique<ROM>(f);
+		bus.InsertROM(*rom);
+		fclose(f);
+
+		cpu.Powerup();
+		cpu.jit.enabled = jit;
+		return (module == nullptr || cpu.jit.LoadModule(module));
+	}
+};
+
+#define COMPARE(what) \
+	if (jit.what != interpreter.what) \
+	{ \
+		fprintf(stderr, "%s differs: %llx (JIT) vs %llx (interpreter)\n", #what, (QWORD)jit.what, (QWORD)interpreter.what); \
+		same = false; \
+	}
+
+#define COMPARE_MEMORY(what) \
+	if (jit.what != interpreter.what) \
+	{ \
+		size_t i = 0; \
+		while (jit.what[i] == interpreter.what[i]) \
+			i++; \
+		fprintf(stderr, "%s differs at offset $%04zx: %02x (JIT) vs %02x (interpreter)\n", #what, i, jit.what[i], interpreter.what[i]); \
+		same = false; \
+	}
+
+static bool Compare(Machine& jit, Machine& interpreter)
+{
+	jit.cpu.SyncFlags();
+	interpreter.cpu.SyncFlags();
+
+	bool same = true;
+	COMPARE(cpu.AF.w);
+	COMPARE(cpu.BC.w);
+	COMPARE(cpu.DE.w);
+	COMPARE(cpu.HL.w);
+	COMPARE(cpu.SP.w);
+	COMPARE(cpu.PC.w);
+	COMPARE(cpu.ime);
+	COMPARE(cpu.halted);
+	COMPARE(cpu.stopped);
+	COMPARE(cpu.cycles);
+	COMPARE(cpu.totalCycles);
+	COMPARE(cpu.instructions);
+	COMPARE(cpu.interruptEnable.b);
+	COMPARE(cpu.interruptFlag.b);
+	COMPARE(bus.internalCounter);
+	COMPARE(bus.writes);
+	COMPARE(bus.invalid);
+	COMPARE(lcd.ly);
+	COMPARE_MEMORY(bus.wram);
+	COMPARE_MEMORY(bus.hram);
+	COMPARE_MEMORY(lcd.vram);
+	COMPARE_MEMORY(lcd.oam);
+	COMPARE_MEMORY(lcd.display);
+
+	return same;
+}
+
+static void PrintUsage()
+{
+	fprintf(stderr, "Usage: yabgbe_jitcheck [--frames N] [--step CYCLES] [--aot MODULE] <ROM>\n");
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	for (int i = 1; i < argc; i++)
+	{
+		bool hasValue = (i + 1 < argc);
+
+		if (!strcmp(argv[i], "--frames") && hasValue)
+			options.frames = strtoull(argv[++i], nullptr, 10);
+		else if (!strcmp(argv[i], "--aot") && hasValue)
+			options.module = argv[++i];
+		else if (!strcmp(argv[i], "--step") && hasValue)
+			options.step = std::max(1ull, strtoull(argv[++i], nullptr, 10));
+		else if (argv[i][0] != '-' && options.rom == nullptr)
+			options.rom = argv[i];
+		else
+		{
+			PrintUsage();
+			return -1;
+		}
+	}
+
+	if (options.rom == nullptr)
+	{
+		PrintUsage();
+		return -1;
+	}
+
+#ifndef JIT_SUPPORTED
+	fprintf(stderr, "The JIT doesn't support this platform, so this would just compare the interpreter with itself\n");
+#endif
+
+	// These are big, keep them off the stack
+	std::unique_ptr<Machine> jit = std::make_unique<Machine>();
+	std::unique_ptr<Machine> interpreter = std::make_unique<Machine>();
+	if (!jit->Load(options.rom, true, options.module) || !interpreter->Load(options.rom, false, nullptr))
+	{
+		EXIT_MSG("Failed to load %s", options.rom);
+		return -1;
+	}
+
+	QWORD end = options.frames * 154 * 456;
+	while (jit->bus.internalCounter < end && !jit->bus.invalid)
+	{
+		QWORD from = jit->bus.internalCounter;
+		QWORD cycle = std::min(end, from + options.step);
+		jit->bus.RunUntil(cycle);
+		interpreter->bus.RunUntil(cycle);
+
+		if (!Compare(*jit, *interpreter))
+		{
+			fprintf(stderr, "Diverged somewhere in between cycles %llu and %llu\n", from, cycle);
+			return 1;
+		}
+	}
+
+	printf("No differences after %llu cycles. %llu blocks compiled, %llu precompiled, %llu of %llu instructions ran in them\n",
+		jit->bus.internalCounter, jit->cpu.jit.compiledBlocks, jit->cpu.jit.precompiledBlocks, jit->cpu.jit.blockInstructions, jit->cpu.instructions);
+	return 0;
+}
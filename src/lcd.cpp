@@ -1,19 +1,12 @@
 #include "lcd.hpp"
 
 #include <assert.h>
+#include <string.h>
+#include <algorithm>
 
 #include "bus.hpp"
 
 static BYTE colormap[4] = { 0b10010011, 0b01001010, 0b00100101, 0b00000000 };
-static WORD lastX = 0xFFFF;
-
-// Reverses a Byte (0111010 -> 0101110)
-BYTE Reverse(BYTE b) {
-	b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
-	b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
-	b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
-	return b;
-}
 
 // initializes a bunch of variables
 void LCD::Setup()
@@ -29,26 +22,194 @@ void LCD::Setup()
 
 	cycles = 0;
 	scanlineCycles = 0;
+	clock = bus->internalCounter;
+	lastModeChange = clock;
 
 	fetcher.cycle = 0;
 	fetcher.x = 0;	fetcher.y = -1;
 	x = 0;
+	lastX = 0xFFFF;
 	dmaCycles = 0;
 
+	bgFIFO.pixels = 0;
 	bgFIFO.full = 0x00;
-	spriteFIFO.full = 0x00;
+	bgFIFO.sprite = 0x00;
+	bgFIFO.spritePalette = 0x00;
+	tileCache.Setup(vram.data());
 	windowMode = false;
+	lineRendered = false;
+
+	spriteCount = 0;
+	nextSprite = 0;
+
+	skipping = false;
+	skippedFrames = 0;
 }
 
-// One LCD tick. Or clock? cycles? who even knows, the wiki uses all of 
-// those terms interchangeably while still insisting they're all different
-void LCD::Tick()
+// The STAT interrupt is level triggered, so as long as one of these holds the
+// interrupt flag gets set again every single dot
+static inline bool StatCondition(STAT stat)
+{
+	return
+		(stat.w.lyc		&& stat.w.coincidence) ||
+		(stat.w.mode2	&& stat.w.mode == 2) ||
+		(stat.w.mode1	&& stat.w.mode == 1) ||
+		(stat.w.mode0	&& stat.w.mode == 0);
+}
+
+#define LAST_PIXEL_DOT	(89 + 19 * 9 + 7)		// The dot the last pixel of a line without the window comes out on
+
+// Where the dot based path is after the given dot of a line without the window. The first tile
+// shows up 8 dots into mode 3, then it's 8 pixels every 9 dots
+static inline BYTE PixelsDrawn(WORD dot)
+{
+	if (dot < 89)
+		return 0;
+	else if (dot >= LAST_PIXEL_DOT)
+		return 160;
+
+	WORD drawing = dot - 89;
+	return (drawing / 9) * 8 + std::min(drawing % 9 + 1, 8);
+}
+
+// The LCD doesn't get ticked along with the CPU anymore. Instead the bus lets it
+// fall behind and only catches it up once somebody could notice the difference
+void LCD::RunUntil(QWORD cycle)
+{
+	while (clock < cycle)
+	{
+		WORD plain = PlainDots();
+		if (plain != 0)
+		{
+			SkipDots((WORD)std::min<QWORD>(plain, cycle - clock));
+			continue;
+		}
+
+		clock++;
+		Tick();
+	}
+}
+
+// How many of the dots after this one don't do anything but count. That's all of V-Blank (except
+// for where the lines start) and everything in the visible lines that isn't the start of mode 3.
+// Mode 3 itself too if the line was done in one go, which is always the case with the LCD off
+// (unless the window gets in the way). The timing stays the same either way
+WORD LCD::PlainDots() const
+{
+	if (ly >= 144)
+	{
+		// The first dot of LY 144 switches to mode 1, if somebody messed with LY or STAT that didn't happen yet
+		if (ly == 144 && (stat.w.mode != 1 || fetcher.y != 0xFF))
+			return 0;
+
+		return 455 - scanlineCycles;
+	}
+
+	if (stat.w.mode == 3)
+		return lineRendered ? 455 - scanlineCycles : 0;
+
+	if (scanlineCycles < 80)
+		return 80 - scanlineCycles;
+	else if (scanlineCycles == 80)
+		return 0;
+
+	return 455 - scanlineCycles;
+}
+
+// Same thing Tick() would do for that many plain dots. The interrupt flag only needs to be set once,
+// nobody can clear it before the LCD caught up
+void LCD::SkipDots(WORD dots)
+{
+	clock += dots;
+	scanlineCycles += dots;
+	cycles += dots;
+
+	stat.w.coincidence = (lyc == ly);
+	bool condition = StatCondition(stat);
+
+	// A line that's already done only has to look like it's still drawing. Tick() switches to H-Blank
+	// on the dot the last pixel comes out, the STAT condition doesn't see that until the dot after
+	if (stat.w.mode == 3 && lineRendered)
+	{
+		x = PixelsDrawn(scanlineCycles);
+		if (x == 160)
+		{
+			stat.w.mode = 0;
+			lastModeChange = clock - (scanlineCycles - LAST_PIXEL_DOT);
+			lineRendered = false;
+
+			if (scanlineCycles > LAST_PIXEL_DOT)
+				condition = StatCondition(stat);
+		}
+	}
+
+	if (condition)
+		bus->cpu->interruptFlag.flags.lcd_stat = 1;
+}
+
+QWORD LCD::NextEvent()
+{
+	// If the STAT condition holds but the flag was cleared, then it's going to be set again right away
+	if (StatCondition(stat) && !bus->cpu->interruptFlag.flags.lcd_stat)
+		return clock + 1;
+
+	// Otherwise nothing can happen until LY or the mode changes. That's either the next scanline
+	// (which also covers V-Blank and OAM search) or the end of the rendering phase if anybody
+	// cares about H-Blank. The rendering phase can't end before the remaining pixels were drawn,
+	// and we draw at most one per dot
+	QWORD next = clock + (456 - scanlineCycles);
+
+	// V-Blank lines all look the same, so unless one of them is the one LYC is waiting for we can
+	// sleep straight through to the first line of the next frame
+	if (ly >= 144 && ly < 153)
+	{
+		BYTE last = (stat.w.lyc && lyc > ly && lyc <= 153) ? lyc : 154;
+		next += (QWORD)(last - ly - 1) * 456;
+	}
+
+	if (ly < 144 && stat.w.mode0)
+	{
+		if (scanlineCycles < 81)
+			next = std::min(next, clock + (81 - scanlineCycles) + 160);
+		else if (stat.w.mode == 3 && x < 160)
+			next = std::min(next, clock + (160 - x));
+	}
+
+	return next;
+}
+
+QWORD LCD::NextModeChange()
+{
+	// Same as above, except that we care about every mode
+	QWORD next = clock + (456 - scanlineCycles);
+	if (ly < 144)
+	{
+		if (scanlineCycles < 81)
+			next = std::min(next, clock + (81 - scanlineCycles));
+		else if (stat.w.mode == 3 && x < 160)
+			next = std::min(next, clock + (160 - x));
+	}
+
+	return next;
+}
+
+QWORD LCD::DisplayHash() const
 {
-	if (lcdc.w.window)
+	// FNV-1a, good enough to tell if the output changed
+	QWORD hash = 0xCBF29CE484222325;
+	for (BYTE pixel : display)
 	{
-		volatile int jdkds = 3;
+		hash ^= pixel;
+		hash *= 0x100000001B3;
 	}
 
+	return hash;
+}
+
+// One LCD tick. Or clock? cycles? who even knows, the wiki uses all of 
+// those terms interchangeably while still insisting they're all different
+void LCD::Tick()
+{
 	// Update cycles
 	scanlineCycles++;
 	cycles++;
@@ -60,6 +221,7 @@ void LCD::Tick()
 		fetcher.cycle = 0;
 		scanlineCycles = 0;
 		ly += 1;
+		lastModeChange = clock;
 
 		// if we reached the bottom then we gotta wrap
 		// back up
@@ -79,12 +241,7 @@ void LCD::Tick()
 		bus->cpu->interruptFlag.flags.vblank = 1;
 	}
 
-	if (
-		(stat.w.lyc		&& stat.w.coincidence) ||
-		(stat.w.mode2	&& stat.w.mode == 2) ||
-		(stat.w.mode1	&& stat.w.mode == 1) ||
-		(stat.w.mode0	&& stat.w.mode == 0)
-		)
+	if (StatCondition(stat))
 	{
 		bus->cpu->interruptFlag.flags.lcd_stat = 1;
 	}
@@ -102,6 +259,7 @@ void LCD::Tick()
 		// Else if we entered screen space, go to the rendering phase
 		else if (scanlineCycles == 81) {
 			stat.w.mode = 3;
+			lastModeChange = clock;
 			bgFIFO.full = 0x00;
 
 			x = 0;
@@ -109,249 +267,378 @@ void LCD::Tick()
 			fetcher.cycle = 0;
 
 			fetcher.y = (fetcher.y + 1) % 8;
-		}
 
+			// Everyone had a chance to make up their mind about this frame by now
+			if (ly == 0)
+			{
+				skipping = skipFrames || skippedFrames < frameSkip;
+				skippedFrames = skipping ? skippedFrames + 1 : 0;
+			}
 
-		// OAM Search
-		if (stat.w.mode == 2)
-		{
-			// Go through all entries in the OAM table and fetch all sprites that are on the current scanline
-			// if there are more than 10 sprites on the scanline, discard the rest by setting y = 0
-			OAMEntry* entry;
-			int counter = 0;
-			for (int i = 0; i < 40; i++)
+			// The OAM search happens in one go at the end of mode 2, nobody can change OAM while it's going on anyways
+			SearchOAM();
+
+			// Lines where the window could show up stay dot by dot, the window check is too weird for this.
+			// With the LCD off there's nothing but color 0 and sprites to draw, so those always go in one go
+			bool window = lcdc.w.window && ly >= wy && wx >= 7 && wx < 160 + 7;
+			if ((scanlineRenderer || !lcdc.w.enable) && !window)
 			{
-				entry = (OAMEntry*)(oam.data() + i * 4);
+				lineFIFO = bgFIFO;
+				lineLastX = lastX;
+				std::copy_n(display.begin() + ly * 160, 160, lineDisplay.begin());
 
-				if (entry->b.y == ly)
-				{
-					counter++;
-					if (counter > 10)
-						entry->b.y = 0;
-				}
+				// Skipped lines don't draw anything, the only thing FetchAndSkip() leaves behind is lastX
+				if (!(skipping && ly < 143))
+					RenderLine();
+				else if (lcdc.w.obj_enable)
+					lastX = 159;
+
+				lineRendered = true;
 			}
 		}
+
+
 		// Pixel Fetcher (oh lord)
-		else if (stat.w.mode == 3)
+		if (stat.w.mode == 3)
 		{
-			if (lcdc.w.obj_enable)		// IF sprite rendering is enabled
-			{
-				if (x != lastX)		// If we already checked this pixel then skip
-				{
-					lastX = x;
-					OAMEntry* entry;
-					for (int i = 0; i < 40; i++)		// Go through all sprites
-					{
-						entry = (OAMEntry*)(oam.data() + i * 4);
-
-						if (x + 8 == entry->b.x && entry->b.y <= ly + 16 && ly + 16 < entry->b.y + 8 + (8 * lcdc.w.obj_size))		// and if the sprite is rendered on the current coordinate
-						{
-							if (entry->b.idx == 0x82)
-								volatile int jdsfklsd = 4;
-
-							// Fetch Sprite!
-							WORD yOffset = (ly - entry->b.y + 16) * 2;		// offset of the tile data in vram
-							if (entry->b.attr.yFlip)
-							{
-								yOffset = 16 * (1 + lcdc.w.obj_size) - 2 - yOffset;		// flip vertically by just doing this
-							}
-
-							BYTE lo = vram[yOffset + (entry->b.idx * 16 * (1 + lcdc.w.obj_size))];		// get lo and hi byte of tile data
-							BYTE hi = vram[yOffset + (entry->b.idx * 16 * (1 + lcdc.w.obj_size)) + 1];
-
-							if (entry->b.attr.xFlip)
-							{
-								lo = Reverse(lo);
-								hi = Reverse(hi);
-							}
-
-							// Feed it all into the spriteFIFO
-							spriteFIFO.lowByte = lo;
-							spriteFIFO.highByte = hi;
-							spriteFIFO.full = 0xFF;
-
-							BYTE counter = 0;
-							while (spriteFIFO.full)		// While theres data in the fifo
-							{
-								BYTE color = ((spriteFIFO.highByte & 0x80) >> 6) | ((spriteFIFO.lowByte & 0x80) >> 7);		// Get color of sprite at that pixel
-
-								if (color != 0x00)		// if its not transparent
-								{
-									BYTE bgPriority = (bgFIFO.sprite & (0x80 >> counter)) >> 6;		// See if there is already a sprite rendered at this pixel (if yes, 
-																									// then dont render over it because sprites with the LOWER x coord get priority)
-
-									if (!bgPriority)
-									{
-										BYTE bgColor = ((bgFIFO.highByte & (0x80 >> counter)) >> 6) | ((bgFIFO.lowByte & (0x80 >> counter)) >> 7);		// Get the color of the background at this pixel
-										
-
-										
-										if (entry->b.attr.bgPriority)			// If the background/window are supposed to have priority do this
-										{
-											if (bgColor == 0x00)
-											{
-												bgFIFO.highByte ^= ((-((spriteFIFO.highByte & 0x80) >> 7) ^ bgFIFO.highByte) & (0x80 >> counter));
-												bgFIFO.lowByte ^= ((-((spriteFIFO.lowByte & 0x80) >> 7) ^ bgFIFO.lowByte) & (0x80 >> counter));
-												bgFIFO.spritePalette ^= ((-entry->b.attr.palette ^ bgFIFO.lowByte) & (0x80 >> counter));
-												bgFIFO.sprite |= (0x80 >> counter);
-											}
-										}
-										else
-										{
-											bgFIFO.highByte ^= ((-((spriteFIFO.highByte & 0x80) >> 7) ^ bgFIFO.highByte) & (0x80 >> counter));
-											bgFIFO.lowByte ^= ((-((spriteFIFO.lowByte & 0x80) >> 7) ^ bgFIFO.lowByte) & (0x80 >> counter));
-											bgFIFO.spritePalette ^= ((-entry->b.attr.palette ^ bgFIFO.lowByte) & (0x80 >> counter));
-											bgFIFO.sprite |= (0x80 >> counter);
-										}
-									}
-								}
-
-								// Advance FIFOs
-								spriteFIFO.full <<= 1;
-								spriteFIFO.highByte <<= 1;
-								spriteFIFO.lowByte <<= 1;
-								counter++;
-							}
-						}
-					}
-				}
-			}
+			// The line is already on the screen, just pretend to still be drawing it
+			if (lineRendered)
+				x = PixelsDrawn(scanlineCycles);
+			else if (skipping && ly < 143)
+				FetchAndSkip();
+			else
+				FetchAndDraw();
 
-			// Okay we're back at rendering the background now
-			switch (fetcher.cycle)
-			{
-			case 0:		// Get Tile
+			if (x == 160)	// if we reached the end of the scanline, enable hblank
 			{
-				// TODO: Implement the window
-				WORD baseAddr = 0x00;
-				if(windowMode)
-					baseAddr = (lcdc.w.window_tilemap ? 0x1C00 : 0x1800);
-				else
-					baseAddr = (lcdc.w.bg_tilemap ? 0x1C00 : 0x1800);
-
-				BYTE fetcherX = ((scx + fetcher.x) & 0xFF) / 8;
-				BYTE fetcherY = ((ly + scy) & 0xFF) / 8;
-				fetcher.tile = vram[baseAddr + (0x20 * fetcherY) + fetcherX];
+				stat.w.mode = 0;
+				lastModeChange = clock;
+				lineRendered = false;
 			}
-			break;
+		}
 
-			case 2:		// Get Tile Data Low
-			{
-				WORD baseAddr = (lcdc.w.tiledata ? 0x0000 : 0x0800);
-				fetcher.lo = vram[baseAddr + 2 * ((fetcher.y + scy) % 8) + (fetcher.tile * 16)];
-				fetcher.lo *= lcdc.w.enable;
-			}
-				break;
-				
-			case 4:		// Get Tile Data High
-			{
-				// TODO: Check LCDC.4
-				WORD baseAddr = (lcdc.w.tiledata ? 0x0000 : 0x0800);
-				fetcher.hi = vram[baseAddr + 2 * ((fetcher.y + scy) % 8) + (fetcher.tile * 16) + 1];
-				fetcher.hi *= lcdc.w.enable;
-			}
-				break;
+	}
+	else if (ly == 144)		// if we're at the end of the screen, enable the vblanking period
+	{
+		stat.w.mode = 1;
+		fetcher.y = -1;
+	}
+}
 
-			case 8:		// Push
-				if (!(bgFIFO.full & 0x00FF))
-				{
-					bgFIFO.lowByte |= fetcher.lo;
-					bgFIFO.highByte |= fetcher.hi;
-					bgFIFO.sprite |= 0x00;
-					bgFIFO.full |= 0xFF;
-					fetcher.cycle = -1;
-				}
-				else
-				{
-					fetcher.cycle--;
-				}
-				
-				fetcher.x--;
+// Everything the pixel fetcher and the FIFOs do in one dot of mode 3
+void LCD::FetchAndDraw()
+{
+	MixSprites();
 
-				break;
-			}
+	// Okay we're back at rendering the background now
+	switch (fetcher.cycle)
+	{
+	case 0:		// Get Tile
+		FetchTile();
+		break;
 
-			fetcher.cycle++;
-			fetcher.x++;
+	case 2:		// Get Tile Data Low
+		fetcher.lo = FetchTileData(0);
+		break;
 
-			// Draw pixels		
-			if (lcdc.w.window && x + 7 == wx && ly >= wy)
-			{
-				bgFIFO.full = 0x00;
-				fetcher.cycle = 0;
-				fetcher.x = x;
-				windowMode = true;
-			}
+	case 4:		// Get Tile Data High
+		// TODO: Check LCDC.4
+		fetcher.hi = FetchTileData(1);
+		break;
 
-			if (bgFIFO.full & 0x00FF)	// If Data in FIFO
-			{
+	case 8:		// Push
+		if (!(bgFIFO.full & 0x00FF))
+		{
+			bgFIFO.pixels |= fetcher.lo | fetcher.hi;
+			bgFIFO.sprite |= 0x00;
+			bgFIFO.full |= 0xFF;
+			fetcher.cycle = -1;
+		}
+		else
+		{
+			fetcher.cycle--;
+		}
 
-				// calculate color 
-				BYTE color = ((bgFIFO.highByte & 0x80) >> 6) | ((bgFIFO.lowByte & 0x80) >> 7);
-				Palette* p = &bgp;
-				if (bgFIFO.sprite & 0x80)
-					p = (bgFIFO.spritePalette & 0x80) ? &obp1 : &obp0;
+		fetcher.x--;
 
-				// set color (pretty easy huh)
-				BYTE displayColor = 0x00;
-				switch (color)
-				{
-				case 0x00:	displayColor = colormap[p->colors.idx0]; break;
-				case 0x01:	displayColor = colormap[p->colors.idx1]; break;
-				case 0x02:	displayColor = colormap[p->colors.idx2]; break;
-				case 0x03:	displayColor = colormap[p->colors.idx3]; break;
-				}
+		break;
+	}
 
-				if ((bgFIFO.sprite & 0x80) && color == 0x00)
-					displayColor = 0x00;
+	fetcher.cycle++;
+	fetcher.x++;
 
-				display[ly * 160 + x] = displayColor;
-				x++;
+	// Draw pixels		
+	if (lcdc.w.window && x + 7 == wx && ly >= wy)
+	{
+		bgFIFO.full = 0x00;
+		fetcher.cycle = 0;
+		fetcher.x = x;
+		windowMode = true;
+	}
 
-				// advance fifo
-				bgFIFO.highByte <<= 1;
-				bgFIFO.lowByte <<= 1;
-				bgFIFO.full <<= 1;
-				bgFIFO.sprite <<= 1;
-				bgFIFO.spritePalette <<= 1;
-			}
+	if (bgFIFO.full & 0x00FF)	// If Data in FIFO
+		DrawPixel();
+}
 
-			if (x == 160)	// if we reached the end of the scanline, enable hblank
+// What's left of FetchAndDraw() if nobody is going to look at the pixels. The FIFO only needs to know
+// how full it is, and lastX has to end up where MixSprites() would've left it
+void LCD::FetchAndSkip()
+{
+	if (lcdc.w.obj_enable)
+		lastX = x;
+
+	if (fetcher.cycle == 8)
+	{
+		if (!(bgFIFO.full & 0x00FF))
+		{
+			bgFIFO.full |= 0xFF;
+			fetcher.cycle = -1;
+		}
+		else
+		{
+			fetcher.cycle--;
+		}
+
+		fetcher.x--;
+	}
+
+	fetcher.cycle++;
+	fetcher.x++;
+
+	if (lcdc.w.window && x + 7 == wx && ly >= wy)
+	{
+		bgFIFO.full = 0x00;
+		fetcher.cycle = 0;
+		fetcher.x = x;
+		windowMode = true;
+	}
+
+	if (bgFIFO.full & 0x00FF)
+	{
+		x++;
+		bgFIFO.full <<= 1;
+	}
+}
+
+// Does exactly what FetchAndDraw() would do over the next 187 dots, minus the dots. Without the
+// window the fetcher pushes a tile into an empty FIFO every 9 dots, and one pixel comes out of it
+// every dot after that. Sprites still get mixed in at the same pixels, so even the weird cases where
+// a sprite ends up in the next tile (or line) come out the same
+void LCD::RenderLine()
+{
+	for (fetcher.x = 0; fetcher.x < 160; fetcher.x += 8)
+	{
+		FetchTile();
+		fetcher.lo = FetchTileData(0);
+		fetcher.hi = FetchTileData(1);
+
+		for (int i = 0; i < 8; i++)
+		{
+			MixSprites();
+			if (i == 0)
 			{
-				stat.w.mode = 0;
+				bgFIFO.pixels |= fetcher.lo | fetcher.hi;
+				bgFIFO.full |= 0xFF;
 			}
+
+			DrawPixel();
 		}
+	}
+}
+
+// Somebody changed something mid line, so put everything back to how it was when mode 3 started and
+// let the dot based path run up to here. Nothing it looks at changed until just now, so it ends up
+// exactly where it would've been if it had been running all along
+void LCD::ReplayLine()
+{
+	bgFIFO = lineFIFO;
+	lastX = lineLastX;
+	std::copy_n(lineDisplay.begin(), 160, display.begin() + ly * 160);
 
+	x = 0;
+	fetcher.x = 0;
+	fetcher.cycle = 0;
+	nextSprite = 0;
+	lineRendered = false;
+
+	bool skipped = skipping && ly < 143;
+	for (WORD dot = 81; dot <= scanlineCycles; dot++)
+	{
+		if (skipped)
+			FetchAndSkip();
+		else
+			FetchAndDraw();
 	}
-	else if (ly == 144)		// if we're at the end of the screen, enable the vblanking period
+}
+
+// Whether a VRAM write could still change the rest of a line that's already done
+bool LCD::LineNeedsVRAM() const
+{
+	if (skipping && ly < 143)
+		return false;
+
+	// With the LCD off it's only the sprites that weren't mixed in yet
+	if (!lcdc.w.enable)
+		return lcdc.w.obj_enable && spriteCount != 0 && lineSprites[spriteCount - 1].b.x >= x + 8;
+
+	return true;
+}
+
+// Picks the (up to) 10 sprites on this line, first come first serve in OAM order, and sorts them by x.
+// Sprites further left win, if two start at the same x the one that comes first in OAM does
+void LCD::SearchOAM()
+{
+	spriteCount = 0;
+	nextSprite = 0;
+
+	BYTE height = 8 + (8 * lcdc.w.obj_size);
+	for (int i = 0; i < 40 && spriteCount < LCD_MAX_SPRITES; i++)
 	{
-		stat.w.mode = 1;
-		fetcher.y = -1;
+		const BYTE* data = oam.data() + i * 4;
+		if (data[0] > ly + 16 || ly + 16 >= data[0] + height)
+			continue;
+
+		OAMEntry sprite;
+		sprite.q = 0;
+		memcpy(&sprite, data, 4);		// Only 4 bytes, the union is bigger than that
+
+		BYTE slot = spriteCount++;
+		while (slot > 0 && lineSprites[slot - 1].b.x > sprite.b.x)
+		{
+			lineSprites[slot] = lineSprites[slot - 1];
+			slot--;
+		}
+
+		lineSprites[slot] = sprite;
 	}
 }
 
+void LCD::MixSprites()
+{
+	if (!lcdc.w.obj_enable)		// IF sprite rendering is enabled
+		return;
+
+	if (x == lastX)		// If we already checked this pixel then skip
+		return;
+
+	lastX = x;
+
+	// The list is sorted by x, so whatever starts left of here was either drawn already or never will be
+	while (nextSprite < spriteCount && lineSprites[nextSprite].b.x < x + 8)
+		nextSprite++;
+
+	for (; nextSprite < spriteCount && lineSprites[nextSprite].b.x == x + 8; nextSprite++)		// Go through the sprites that start right here
+	{
+		OAMEntry* entry = &lineSprites[nextSprite];
+		// Fetch Sprite!
+		WORD yOffset = (ly - entry->b.y + 16) * 2;		// offset of the tile data in vram
+		if (entry->b.attr.yFlip)
+		{
+			yOffset = 16 * (1 + lcdc.w.obj_size) - 2 - yOffset;		// flip vertically by just doing this
+		}
+
+		QWORD row = tileCache.Row(yOffset + (entry->b.idx * 16 * (1 + lcdc.w.obj_size)), entry->b.attr.xFlip);		// get the row, already flipped if it has to be
+
+		for (BYTE counter = 0; counter < 8; counter++)
+		{
+			BYTE color = (row >> (counter * 8)) & 0x03;		// Get color of sprite at that pixel
+
+			if (color != 0x00)		// if its not transparent
+			{
+				BYTE bgPriority = (bgFIFO.sprite & (0x80 >> counter)) >> 6;		// See if there is already a sprite rendered at this pixel (if yes, 
+																				// then dont render over it because sprites with the LOWER x coord get priority)
+
+				if (!bgPriority)
+				{
+					// Get the color of the background at this pixel. The shift is what the old bitplane version of this
+					// ended up doing (it only ever saw the first two pixels properly), and it's what everything looks like
+					BYTE bgColor = ((bgFIFO.pixels >> (counter * 8)) & 0x03) >> counter;
+
+					if (!entry->b.attr.bgPriority || bgColor == 0x00)		// If the background/window are supposed to have priority only draw over color 0
+					{
+						bgFIFO.pixels = (bgFIFO.pixels & ~(0xFFull << (counter * 8))) | ((QWORD)color << (counter * 8));
+						bgFIFO.spritePalette ^= ((-entry->b.attr.palette ^ -(color & 0x01)) & (0x80 >> counter));
+						bgFIFO.sprite |= (0x80 >> counter);
+					}
+				}
+			}
+		}
+	}
+}
+
+void LCD::FetchTile()
+{
+	// TODO: Implement the window
+	WORD baseAddr = 0x00;
+	if(windowMode)
+		baseAddr = (lcdc.w.window_tilemap ? 0x1C00 : 0x1800);
+	else
+		baseAddr = (lcdc.w.bg_tilemap ? 0x1C00 : 0x1800);
+
+	BYTE fetcherX = ((scx + fetcher.x) & 0xFF) / 8;
+	BYTE fetcherY = ((ly + scy) & 0xFF) / 8;
+	fetcher.tile = vram[baseAddr + (0x20 * fetcherY) + fetcherX];
+}
+
+// Low (0) or high (1) bits of the color indices in the current row of the tile. The fetcher reads those
+// at different dots, so they stay apart until the push in case somebody changes something in between
+QWORD LCD::FetchTileData(BYTE plane)
+{
+	WORD baseAddr = (lcdc.w.tiledata ? 0x0000 : 0x0800);
+	QWORD row = tileCache.Row(baseAddr + 2 * ((fetcher.y + scy) % 8) + (fetcher.tile * 16), false);
+	return (row & (0x0101010101010101ull << plane)) * lcdc.w.enable;
+}
+
+void LCD::DrawPixel()
+{
+	// calculate color 
+	BYTE color = bgFIFO.pixels & 0x03;
+	Palette* p = &bgp;
+	if (bgFIFO.sprite & 0x80)
+		p = (bgFIFO.spritePalette & 0x80) ? &obp1 : &obp0;
+
+	// set color (pretty easy huh)
+	BYTE displayColor = colormap[(p->b >> (color * 2)) & 0x03];
+	if ((bgFIFO.sprite & 0x80) && color == 0x00)
+		displayColor = 0x00;
+
+	if (!skipping)
+		display[ly * 160 + x] = displayColor;
+
+	x++;
+
+	// advance fifo
+	bgFIFO.pixels >>= 8;
+	bgFIFO.full <<= 1;
+	bgFIFO.sprite <<= 1;
+	bgFIFO.spritePalette <<= 1;
+}
+
 bool LCD::Read(WORD addr, BYTE& val)
 {
 	if (0x8000 <= addr && addr < 0xA000)		// VRAM
 	{
+		RunUntil(bus->internalCounter);
 		if (stat.w.mode != 3 || !lcdc.w.enable)
 			val = vram[addr & 0x1FFF];
 		else
-			val = undefined;
+			val = bus->undefined;
 
 		return true;
 	}
 	else if (0xFE00 <= addr && addr < 0xFEA0)	// OAM
 	{
+		RunUntil(bus->internalCounter);
 		if (stat.w.mode == 0 || stat.w.mode == 1 || !lcdc.w.enable)
 			val = oam[addr & 0x9F];
 		else
-			val = undefined;
+			val = bus->undefined;
 
 		return true;
 	}
-	else if (0xFF00 <= addr && addr < 0xFF80)	// I/O
+	else if (0xFF40 <= addr && addr < 0xFF4C)	// I/O
 	{
+		RunUntil(bus->internalCounter);
 		switch (addr)
 		{
 		case 0xFF40:	val = lcdc.b;	return true;
@@ -377,20 +664,33 @@ bool LCD::Write(WORD addr, BYTE val)
 {
 	if (0x8000 <= addr && addr < 0xA000)		// VRAM
 	{
+		RunUntil(bus->internalCounter);
 		if (stat.w.mode != 3 || !lcdc.w.enable)
+		{
+			if (lineRendered && LineNeedsVRAM())
+				ReplayLine();
+
 			vram[addr & 0x1FFF] = val;
+			tileCache.Invalidate(addr);
+		}
 
 		return true;
 	}
 	else if (0xFE00 <= addr && addr < 0xFEA0)	// OAM
 	{
+		RunUntil(bus->internalCounter);
+		// The line that's being drawn already got its sprites out of here, so it doesn't care
 		if (stat.w.mode == 0 || stat.w.mode == 1 || !lcdc.w.enable)
 			oam[addr & 0x9F] = val;
 
 		return true;
 	}
-	else if (0xFF00 <= addr && addr < 0xFF80)	// I/O
+	else if (0xFF40 <= addr && addr < 0xFF4C)	// I/O
 	{
+		RunUntil(bus->internalCounter);
+		if (lineRendered)		// Any of these could change what the rest of the line looks like
+			ReplayLine();
+
 		switch (addr)
 		{
 		case 0xFF40:	lcdc.b = val;	return true;
@@ -2,9 +2,12 @@
 
 #include <array>
 #include "util.hpp"
+#include "tilecache.hpp"
 
 class Bus;
 
+#define LCD_MAX_SPRITES		10		// Per line, the rest just doesn't get drawn
+
 // bunch of registers or smthn
 typedef union
 {
@@ -50,7 +53,7 @@ typedef struct
 {
 	WORD spritePalette;
 	WORD sprite;
-	WORD highByte, lowByte;
+	QWORD pixels;		// Color indices, one per byte. The next one to come out is the lowest
 	WORD full;
 } PixelFIFO;
 
@@ -59,7 +62,7 @@ typedef struct
 	WORD tile;
 	BYTE cycle;
 	BYTE x, y;
-	BYTE lo, hi;
+	QWORD lo, hi;		// Low and high bits of the row's color indices, laid out like PixelFIFO::pixels
 } PixelFetcher;
 
 typedef union
@@ -102,12 +105,31 @@ class LCD
 public:
 	void Setup();
 	void Tick();
+	void RunUntil(QWORD cycle);		// Catch the LCD up to the given cycle of the bus
+	WORD PlainDots() const;
+	void SkipDots(WORD dots);
+	QWORD NextEvent();				// Earliest cycle at which the LCD could raise an interrupt that isn't already pending
+	QWORD NextModeChange();			// Earliest cycle at which LY or the mode could change
+	QWORD DisplayHash() const;		// Fingerprint of the screen buffer, to tell if two runs look the same
 
 	bool Read(WORD addr, BYTE& val);
 	bool Write(WORD addr, BYTE val);
 
+	void FetchAndDraw();			// One dot worth of pixel fetcher and FIFOs (mode 3)
+	void FetchAndSkip();			// Same thing for skipped frames, only keeps track of where it would be
+	void RenderLine();				// All of mode 3 in one go, for the scanline renderer
+	void ReplayLine();				// Forgets about the line RenderLine() drew and catches up dot by dot instead
+	bool LineNeedsVRAM() const;		// Whether a VRAM write means the line has to be replayed
+	void SearchOAM();				// Finds the sprites on the current line
+	void MixSprites();				// Puts the sprites that start at x into the FIFO
+	void FetchTile();
+	QWORD FetchTileData(BYTE plane);
+	void DrawPixel();
+
 	DWORD cycles;
 	WORD scanlineCycles;
+	QWORD clock;			// Bus cycle the LCD has been run up to. It lags behind the CPU until someone looks at it
+	QWORD lastModeChange;	// Bus cycle at which LY or the mode changed for the last time
 
 	friend class Bus;
 	friend class CPU;
@@ -116,6 +138,7 @@ public:
 	std::array<BYTE, 160 * 144> display;
 	std::array<BYTE, 0x2000> vram;
 	std::array<BYTE, 0xA0> oam;
+	TileCache tileCache;		// Decoded VRAM, the PPU and the debug views read their tiles from here
 
 public:
 	Bus* bus;
@@ -136,9 +159,31 @@ public:
 
 	PixelFetcher	fetcher;
 	PixelFIFO		bgFIFO;
-	PixelFIFO		spriteFIFO;
 
 	BYTE x;
+	WORD lastX;			// Last pixel we looked for sprites on
+
+	std::array<OAMEntry, LCD_MAX_SPRITES> lineSprites;		// What the OAM search found, sorted by x
+	BYTE spriteCount;
+	BYTE nextSprite;			// First one that wasn't mixed in yet
 	BYTE dmaCycles;
 	bool windowMode;
+
+	// The scanline renderer draws a line as soon as mode 3 starts instead of one pixel per dot. That's only
+	// the same thing as long as nobody touches the registers, VRAM or OAM during mode 3, so if someone does
+	// the line gets thrown away and redone the slow way. Lines that could hit the window always go the slow way.
+	// With the LCD off the same thing happens even without the scanline renderer, those lines are nearly empty
+	bool scanlineRenderer = false;
+	bool lineRendered;						// The current line was drawn by RenderLine() (or skipped in one go)
+	PixelFIFO lineFIFO;						// And what things looked like before that
+	WORD lineLastX;
+	std::array<BYTE, 160> lineDisplay;
+
+	// Skipped frames do everything a drawn frame does (timing, LY, STAT, interrupts, VRAM and OAM locking),
+	// they just don't fetch, mix or draw any pixels. The last line still goes through the FIFO (without
+	// drawing) so the next frame starts with the same leftovers it would've had anyways
+	WORD frameSkip = 0;			// Draw one frame, then skip this many
+	bool skipFrames = false;	// Skip every frame until this is turned off again, for callers that decide on their own
+	bool skipping = false;		// Whether the current frame is skipped. Decided when line 0 starts drawing
+	QWORD skippedFrames = 0;	// In a row
 };
@@ -1,6 +1,8 @@
 #include "bus.hpp"
 
 #include <iostream>
+#include <chrono>
+#include <string.h>
 
 #include <SDL.h>
 #include <glad.h>
@@ -12,8 +14,226 @@ static BYTE colormap[4] = { 0b00000000, 0b00100101, 0b01001010, 0b10010011 };
 
 #undef main
 
+// Everything you can tell the emulator from the command line
+struct Options
+{
+	const char* rom = nullptr;
+	bool jit = false;
+	const char* module = nullptr;		// Made by yabgbe_aot
+	bool scanline = false;				// Draw whole lines at once instead of dot by dot
+	WORD frameSkip = 0;					// Frames to skip after every one that gets drawn
+
+	bool headless = false;
+	QWORD frames = 0;
+	QWORD cycles = 0;
+	const char* displayFile = nullptr;
+	const char* wramFile = nullptr;
+
+	const char* traceFile = nullptr;	// Where the trace goes once we're done. Read it with yabgbe_trace
+	size_t traceSize = TRACE_DEFAULT_SIZE;
+
+	const char* profileFile = nullptr;	// Collapsed stacks, for flamegraphs
+	QWORD profileInterval = PROFILER_DEFAULT_INTERVAL;
+	bool profileCalls = false;
+	const char* symbolFile = nullptr;	// RGBDS .sym
+
+	const char* opcodeFile = nullptr;	// Needs a build with OPCODE_STATS
+};
+
+static bool ParseOptions(int argc, char** argv, Options& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		// All the options that take a value need one more argument
+		bool hasValue = (i + 1 < argc);
+
+		if (!strcmp(argv[i], "--headless"))
+			options.headless = true;
+		else if (!strcmp(argv[i], "--jit"))
+			options.jit = true;
+		else if (!strcmp(argv[i], "--scanline"))
+			options.scanline = true;
+		else if (!strcmp(argv[i], "--frame-skip") && hasValue)
+			options.frameSkip = (WORD)strtoul(argv[++i], nullptr, 10);
+		else if (!strcmp(argv[i], "--aot") && hasValue)
+			options.module = argv[++i];
+		else if (!strcmp(argv[i], "--frames") && hasValue)
+			options.frames = strtoull(argv[++i], nullptr, 10);
+		else if (!strcmp(argv[i], "--cycles") && hasValue)
+			options.cycles = strtoull(argv[++i], nullptr, 10);
+		else if (!strcmp(argv[i], "--dump-display") && hasValue)
+			options.displayFile = argv[++i];
+		else if (!strcmp(argv[i], "--dump-wram") && hasValue)
+			options.wramFile = argv[++i];
+		else if (!strcmp(argv[i], "--trace") && hasValue)
+			options.traceFile = argv[++i];
+		else if (!strcmp(argv[i], "--trace-size") && hasValue)
+			options.traceSize = strtoull(argv[++i], nullptr, 10);
+		else if (!strcmp(argv[i], "--profile") && hasValue)
+			options.profileFile = argv[++i];
+		else if (!strcmp(argv[i], "--profile-interval") && hasValue)
+			options.profileInterval = strtoull(argv[++i], nullptr, 10);
+		else if (!strcmp(argv[i], "--profile-calls"))
+			options.profileCalls = true;
+		else if (!strcmp(argv[i], "--symbols") && hasValue)
+			options.symbolFile = argv[++i];
+		else if (!strcmp(argv[i], "--opcode-stats") && hasValue)
+			options.opcodeFile = argv[++i];
+		else if (argv[i][0] != '-' && options.rom == nullptr)
+			options.rom = argv[i];
+		else
+			return false;
+	}
+
+	return (options.rom != nullptr);
+}
+
+static bool DumpToFile(const char* filename, const BYTE* data, size_t size)
+{
+	FILE* f = fopen(filename, "wb");
+	if (f == nullptr)
+	{
+		EXIT_MSG("Failed to open %s", filename);
+		return false;
+	}
+
+	fwrite(data, 1, size, f);
+	fclose(f);
+	return true;
+}
+
+// Runs the ROM as fast as possible without any window, ImGui or anything else SDL related
+static int RunHeadless(const Options& options)
+{
+	Bus bus;
+	CPU cpu;
+	LCD lcd;
+
+	bus.AttachCPU(cpu);
+	bus.AttachLCD(lcd);
+
+	FILE* f = fopen(options.rom, "rb");
+	if (f == nullptr)
+	{
+		EXIT_MSG("Failed to open %s", options.rom);
+		return -1;
+	}
+
+	ROM rom(f);
+	fclose(f);
+
+	bus.InsertROM(rom);
+
+	cpu.Powerup();
+	cpu.jit.enabled = options.jit;
+	lcd.scanlineRenderer = options.scanline;
+	lcd.frameSkip = options.frameSkip;
+	if (options.module != nullptr && !cpu.jit.LoadModule(options.module))
+	{
+		EXIT_MSG("Failed to load %s", options.module);
+		return -1;
+	}
+
+	Trace trace(options.traceSize);
+	if (options.traceFile != nullptr)
+		cpu.trace = &trace;
+
+	Profiler profiler(options.profileInterval);
+	profiler.trackCalls = options.profileCalls;
+	if (options.symbolFile != nullptr && !profiler.LoadSymbols(options.symbolFile))
+		return -1;
+
+	if (options.profileFile != nullptr)
+		profiler.Start(bus);
+
+#ifndef OPCODE_STATS
+	if (options.opcodeFile != nullptr)
+	{
+		fprintf(stderr, "--opcode-stats needs a build with OPCODE_STATS (YABGBE_OPCODE_STATS in CMake)\n");
+		return -1;
+	}
+#endif
+
+	// If nobody told us how long to run, just do 10 seconds worth of frames
+	QWORD frames = options.frames;
+	if (frames == 0 && options.cycles == 0)
+		frames = 600;
+
+	auto start = std::chrono::steady_clock::now();
+
+	// A frame is 154 scanlines of 456 dots each
+	double emulatedFrames = 0.0;
+	if (options.cycles != 0)
+	{
+		bus.RunUntil(bus.internalCounter + options.cycles);
+		emulatedFrames = (double)bus.internalCounter / (154 * 456);
+	}
+	else
+	{
+		for (; emulatedFrames < frames && !bus.invalid; emulatedFrames++)
+		{
+			// Frame() can end up a bit into the next frame, so stop skipping two frames early to get a proper picture at the end
+			lcd.frameSkip = (emulatedFrames + 2 < frames) ? options.frameSkip : 0;
+			bus.Frame();
+		}
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("Ran %.0f frames (%llu cycles) in %.3f s\n", emulatedFrames, bus.internalCounter, seconds);
+	printf("%.1f frames/s, %.0f cycles/s (%.1fx realtime)\n", emulatedFrames / seconds, bus.internalCounter / seconds, bus.internalCounter / seconds / 4194304.0);
+	printf("Idle loops: %llu hits, %llu cycles skipped\n", cpu.idleStats.hits, cpu.idleStats.skippedCycles);
+	printf("Copy/fill loops: %llu run at once, %llu cycles worth\n", cpu.idleStats.bulkLoops, cpu.idleStats.bulkCycles);
+	if (options.jit || options.module != nullptr)
+		printf("JIT: %llu blocks compiled, %llu precompiled, %llu of %llu instructions ran in them\n", cpu.jit.compiledBlocks, cpu.jit.precompiledBlocks, cpu.jit.blockInstructions, cpu.instructions);
+
+	if (bus.invalid)
+		printf("The CPU ran into an invalid opcode at $%04x\n", cpu.PC.w);
+
+	if (options.displayFile != nullptr && !DumpToFile(options.displayFile, lcd.display.data(), lcd.display.size()))
+		return -1;
+
+	if (options.wramFile != nullptr && !DumpToFile(options.wramFile, bus.wram.data(), bus.wram.size()))
+		return -1;
+
+	// Especially useful if the CPU just crashed
+	if (options.traceFile != nullptr && !trace.Save(options.traceFile))
+		return -1;
+
+	if (options.profileFile != nullptr)
+	{
+		printf("Profile: %llu samples\n", profiler.samples);
+		for (const auto& [name, count] : profiler.Top(10))
+			printf("%6.2f%%  %s\n", 100.0 * count / profiler.samples, name.c_str());
+
+		if (!profiler.SaveCollapsed(options.profileFile))
+			return -1;
+	}
+
+#ifdef OPCODE_STATS
+	if (options.opcodeFile != nullptr && !cpu.opcodeStats.Save(options.opcodeFile))
+		return -1;
+#endif
+
+	return bus.invalid ? 1 : 0;
+}
+
 int main(int argc, char** argv)
 {
+	Options options;
+	bool validOptions = ParseOptions(argc, argv, options);
+
+	if (options.headless)
+	{
+		if (!validOptions)
+		{
+			std::cerr << "Usage: gbemu --headless [--jit] [--aot MODULE] [--scanline] [--frame-skip N] [--frames N | --cycles N] [--dump-display FILE] [--dump-wram FILE] [--trace FILE [--trace-size N]] [--profile FILE [--profile-interval N] [--profile-calls] [--symbols FILE]] [--opcode-stats FILE] <ROM>" << std::endl;
+			return -1;
+		}
+
+		return RunHeadless(options);
+	}
+
 	// Calculate the size of the window? This is literally random lol
 	int width = (512 + 384) * 2 + 10;
 	int height = 256 * 4;
@@ -89,19 +309,40 @@ int main(int argc, char** argv)
 	bus.AttachLCD(lcd);
 
 	// Load the rom
-	if (argc != 2)
+	if (!validOptions)
 	{
 		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Failed to load ROM", "Usage: gbemu <ROM>\nOr drag and drop a ROM onto the executable.", window);
 		exit(-1);
 	}
 
-	FILE* f = fopen(argv[1], "rb");
+	FILE* f = fopen(options.rom, "rb");
 	ROM rom(f);
 	fclose(f);
 
 	bus.InsertROM(rom);
 
 	cpu.Powerup();
+	cpu.jit.enabled = options.jit;
+	lcd.scanlineRenderer = options.scanline;
+	lcd.frameSkip = options.frameSkip;
+	if (options.module != nullptr && !cpu.jit.LoadModule(options.module))
+		std::cerr << "Failed to load " << options.module << ", running without it" << std::endl;
+
+	// Can be switched on and off in the CPU window too
+	Trace trace(options.traceSize);
+	const char* traceFile = (options.traceFile != nullptr) ? options.traceFile : "yabgbe.trace";
+	if (options.traceFile != nullptr)
+		cpu.trace = &trace;
+
+	// Same for the profiler
+	Profiler profiler(options.profileInterval);
+	const char* profileFile = (options.profileFile != nullptr) ? options.profileFile : "yabgbe.folded";
+	profiler.trackCalls = options.profileCalls;
+	if (options.symbolFile != nullptr && !profiler.LoadSymbols(options.symbolFile))
+		std::cerr << "Failed to load " << options.symbolFile << ", running without symbols" << std::endl;
+
+	if (options.profileFile != nullptr)
+		profiler.Start(bus);
 
 	// Placeholder vars for pixel arrays used to calcualte the rendered tilemaps
 	BYTE* tilemappixels1;
@@ -216,27 +457,16 @@ int main(int argc, char** argv)
 				BYTE tile1ID = lcd.vram[0x1800 + (tileY * 32) + tileX];
 				BYTE tile2ID = lcd.vram[0x1C00 + (tileY * 32) + tileX];
 
-				WORD baseAddr = (lcd.lcdc.w.tiledata ? 0x0000 : 0x0800);
-				WORD addr1 = baseAddr + (tile1ID * 16);
-				WORD addr2 = baseAddr + (tile2ID * 16);
+				WORD baseTile = (lcd.lcdc.w.tiledata ? 0x00 : 0x80);
+				const BYTE* pixels1 = lcd.tileCache.Pixels(baseTile + tile1ID, false);
+				const BYTE* pixels2 = lcd.tileCache.Pixels(baseTile + tile2ID, false);
 
 				for (int y = 0; y < 8; y++)
 				{
-					BYTE lo1 = lcd.vram[addr1 + 2 * y];
-					BYTE hi1 = lcd.vram[addr1 + 2 * y + 1];
-
-					BYTE lo2 = lcd.vram[addr2 + 2 * y];
-					BYTE hi2 = lcd.vram[addr2 + 2 * y + 1];
 					for (int x = 0; x < 8; x++)
 					{
-						BYTE loVal1 = (lo1 & (0x80 >> x)) >> (7 - x);
-						BYTE hiVal1 = (hi1 & (0x80 >> x)) >> (7 - x);
-
-						BYTE loVal2 = (lo2 & (0x80 >> x)) >> (7 - x);
-						BYTE hiVal2 = (hi2 & (0x80 >> x)) >> (7 - x);
-
-						tilemappixels1[(tileX * 8 + x) + (32 * 8) * (tileY * 8 + y)] = colormap[loVal1 + (hiVal1 << 1)];
-						tilemappixels2[(tileX * 8 + x) + (32 * 8) * (tileY * 8 + y)] = colormap[loVal2 + (hiVal2 << 2)];
+						tilemappixels1[(tileX * 8 + x) + (32 * 8) * (tileY * 8 + y)] = colormap[pixels1[y * 8 + x]];
+						tilemappixels2[(tileX * 8 + x) + (32 * 8) * (tileY * 8 + y)] = colormap[pixels2[y * 8 + x]];
 					}
 				}
 			}
@@ -279,6 +509,7 @@ int main(int argc, char** argv)
 		ImGui::End();
 
 		ImGui::Begin("CPU");
+		cpu.SyncFlags();
 		ImGui::Text("-- Registers --");
 		if (ImGui::BeginTable("Registers", 6))
 		{
@@ -343,6 +574,72 @@ int main(int argc, char** argv)
 			ImGui::EndTable();
 		}
 
+		ImGui::Separator();
+		ImGui::Text("-- Idle Loops --");
+		ImGui::Text("Hits: %llu  Skipped cycles: %llu", cpu.idleStats.hits, cpu.idleStats.skippedCycles);
+		ImGui::Text("Copy/fill loops: %llu  Cycles: %llu", cpu.idleStats.bulkLoops, cpu.idleStats.bulkCycles);
+		if (ImGui::BeginTable("IdleLoops", 2))
+		{
+			ImGui::TableNextColumn();	ImGui::Text("$");
+			ImGui::TableNextColumn();	ImGui::Text("Hits");
+
+			for (const auto& loop : cpu.idleStats.loops)
+			{
+				ImGui::TableNextColumn();	ImGui::Text("%04x", loop.first);
+				ImGui::TableNextColumn();	ImGui::Text("%llu", loop.second);
+			}
+
+			ImGui::EndTable();
+		}
+
+		ImGui::Separator();
+		ImGui::Text("-- Trace --");
+		bool tracing = (cpu.trace != nullptr);
+		if (ImGui::Checkbox("Record", &tracing))
+			cpu.trace = tracing ? &trace : nullptr;
+
+		ImGui::SameLine();
+		if (ImGui::Button("Save"))
+			trace.Save(traceFile);
+
+		ImGui::SameLine();
+		ImGui::Text("%zu entries -> %s", trace.Count(), traceFile);
+
+		ImGui::Separator();
+		ImGui::Text("-- Profiler --");
+		bool profiling = (cpu.profiler != nullptr);
+		if (ImGui::Checkbox("Sample", &profiling))
+		{
+			if (profiling)
+				profiler.Start(bus);
+			else
+				profiler.Stop();
+		}
+
+		ImGui::SameLine();
+		ImGui::Checkbox("Calls", &profiler.trackCalls);
+		ImGui::SameLine();
+		if (ImGui::Button("Reset"))
+			profiler.Clear();
+
+		ImGui::SameLine();
+		if (ImGui::Button("Save##Profile"))
+			profiler.SaveCollapsed(profileFile);
+
+		if (profiler.samples != 0 && ImGui::BeginTable("Profile", 2))
+		{
+			ImGui::TableNextColumn();	ImGui::Text("%%");
+			ImGui::TableNextColumn();	ImGui::Text("Where");
+
+			for (const auto& [name, count] : profiler.Top(10))
+			{
+				ImGui::TableNextColumn();	ImGui::Text("%.2f", 100.0 * count / profiler.samples);
+				ImGui::TableNextColumn();	ImGui::Text("%s", name.c_str());
+			}
+
+			ImGui::EndTable();
+		}
+
 		if (bus.cpu->stopped)
 		{
 			ImGui::Separator();
@@ -381,6 +678,11 @@ int main(int argc, char** argv)
 
 		ImGui::Begin("Gameboy");
 		ImGui::Image(gameboyScreen, ImVec2(ImGui::GetWindowContentRegionWidth(), ImGui::GetWindowContentRegionWidth() / gbAR));
+		ImGui::Checkbox("Scanline renderer", &lcd.scanlineRenderer);		// Kicks in from the next line on
+
+		int frameSkip = lcd.frameSkip;
+		if (ImGui::SliderInt("Frame skip", &frameSkip, 0, 9))
+			lcd.frameSkip = frameSkip;
 		ImGui::End();
 
 		// Clear screen and render ImGui
@@ -411,5 +713,11 @@ int main(int argc, char** argv)
 
 	SDL_Quit();
 
+	if (options.traceFile != nullptr)
+		trace.Save(options.traceFile);
+
+	if (options.profileFile != nullptr)
+		profiler.SaveCollapsed(options.profileFile);
+
 	return 0;
 }
@@ -3,6 +3,11 @@
 #include "../util.hpp"
 
 // The memory bank controller (MBC) needs to map addresses targeted at rom, to get the appropriate data from the ROM
+// Every MBC has these two (not virtual, the ROM knows which MBC it has and calls them directly):
+//
+//		bool GetMappedRead(WORD address, DWORD& mappedAddr);				// Convert CPU address to ROM internal address
+//		bool GetMappedWrite(WORD address, BYTE val, DWORD& mappedAddr);
+//
 class IMBC
 {
 public:
@@ -10,11 +15,6 @@ public:
 		romBanks(romBanks), ramBanks(ramBanks), ramSize(ramSize)
 	{ }
 
-	virtual ~IMBC() {}
-
-	virtual bool GetMappedRead(WORD address, DWORD& mappedAddr) = 0;				// Convert CPU address to ROM internal address
-	virtual bool GetMappedWrite(WORD address, BYTE val, DWORD& mappedAddr) = 0;
-
 protected:
 	WORD romBanks, ramBanks, ramSize;
 };
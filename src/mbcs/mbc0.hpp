@@ -5,10 +5,10 @@
 class MBC0 : public IMBC
 {
 public:
-	MBC0(WORD ramBanks) : IMBC(2, ramBanks, 8) {}
+	MBC0(WORD ramBanks = 0) : IMBC(2, ramBanks, 8) {}
 
-	virtual bool GetMappedRead(WORD address, DWORD& mappedAddress) override;
-	virtual bool GetMappedWrite(WORD address, BYTE val, DWORD& mappedAddress) override;
+	bool GetMappedRead(WORD address, DWORD& mappedAddress);
+	bool GetMappedWrite(WORD address, BYTE val, DWORD& mappedAddress);
 private:
 };
 
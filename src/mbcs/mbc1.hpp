@@ -7,16 +7,30 @@ class MBC1 : public IMBC
 public:
 	MBC1(WORD romBanks, WORD ramBanks, WORD ramSize) : IMBC(romBanks, ramBanks, ramSize) {}
 
-	virtual bool GetMappedRead(WORD address, DWORD& mappedAddr) override;
-	virtual bool GetMappedWrite(WORD address, BYTE val, DWORD& mappedAddr) override;
+	bool GetMappedRead(WORD address, DWORD& mappedAddr);
+	bool GetMappedWrite(WORD address, BYTE val, DWORD& mappedAddr);
+
+private:
+	void UpdateOffsets();
 
 private:
 	BYTE RamEnable = 0x00;
 	BYTE RomBankNumber = 0x01;
 	BYTE RamBankNumber = 0x00;
 	BYTE ModeSelect = 0x00;
+
+	// Where the switchable banks start. These only change when one of the registers above
+	// does, so there's no point in doing the math on every single read
+	DWORD romOffset = 0x4000;
+	DWORD ramOffset = 0x0000;
 };
 
+inline void MBC1::UpdateOffsets()
+{
+	romOffset = (DWORD)((RamBankNumber << (5 * !ModeSelect)) | RomBankNumber) * 0x4000;
+	ramOffset = (DWORD)(RamBankNumber * ModeSelect) * 0x2000;
+}
+
 inline bool MBC1::GetMappedRead(WORD address, DWORD& mappedAddr)
 {
 	if (address < 0x4000)
@@ -26,12 +40,12 @@ inline bool MBC1::GetMappedRead(WORD address, DWORD& mappedAddr)
 	}
 	else if(0x4000 <= address && address < 0x8000)
 	{
-		mappedAddr = ((DWORD)((RamBankNumber << (5 * !ModeSelect)) | RomBankNumber) * 0x4000) + (address & 0x3FFF);
+		mappedAddr = romOffset + (address & 0x3FFF);
 		return true;
 	}
 	else if (0xA000 <= address && address < 0xC000)
 	{
-		mappedAddr = (DWORD)((RamBankNumber * ModeSelect) * 0x2000) + (address & 0x1FFF);
+		mappedAddr = ramOffset + (address & 0x1FFF);
 		return true;
 	}
 
@@ -50,21 +64,24 @@ inline bool MBC1::GetMappedWrite(WORD address, BYTE val, DWORD& mappedAddr)
 		RomBankNumber = val;
 		if (RomBankNumber == 0x00 || RomBankNumber == 0x20 || RomBankNumber == 0x40 || RomBankNumber == 0x60)
 			RomBankNumber += 1;
+		UpdateOffsets();
 		return false;
 	}
 	else if (0x4000 <= address && address < 0x6000)
 	{
 		RamBankNumber = val;
+		UpdateOffsets();
 		return false;
 	}
 	else if (0x6000 <= address && address < 0x8000)
 	{
 		ModeSelect = val;
+		UpdateOffsets();
 		return false;
 	}
 	else if (ramBanks == 0 && 0xA000 <= address && address < 0xC000)
 		return false;
 
-	mappedAddr = (DWORD)((RamBankNumber * ModeSelect) * 0x2000) + (address & 0x1FFF);
+	mappedAddr = ramOffset + (address & 0x1FFF);
 	return true;
 }
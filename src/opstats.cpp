@@ -0,0 +1,87 @@
+#include "opstats.hpp"
+
+#include <errno.h>
+
+// $3e or $cb7c, so CB opcodes sort right after the normal ones
+static void OpcodeName(size_t opcode, char* name, size_t size)
+{
+	if (opcode >= 0x100)
+		snprintf(name, size, "$cb%02zx", opcode & 0xFF);
+	else
+		snprintf(name, size, "$%02zx", opcode);
+}
+
+void OpcodeStats::Add(const OpcodeStats& other)
+{
+	for (size_t i = 0; i < counts.size(); i++)
+	{
+		counts[i] += other.counts[i];
+		cycles[i] += other.cycles[i];
+	}
+}
+
+QWORD OpcodeStats::Total() const
+{
+	QWORD total = 0;
+	for (QWORD count : counts)
+		total += count;
+
+	return total;
+}
+
+bool OpcodeStats::Save(const char* filename) const
+{
+	FILE* f = fopen(filename, "w");
+	if (f == nullptr)
+	{
+		EXIT_MSG("Failed to open %s", filename);
+		return false;
+	}
+
+	size_t length = strlen(filename);
+	if (length >= 5 && !strcmp(filename + length - 5, ".json"))
+	{
+		WriteJSON(f, "");
+		fprintf(f, "\n");
+	}
+	else
+		WriteCSV(f);
+
+	fclose(f);
+	return true;
+}
+
+void OpcodeStats::WriteCSV(FILE* f) const
+{
+	QWORD total = Total();
+
+	fprintf(f, "opcode,count,cycles,share\n");
+	for (size_t i = 0; i < counts.size(); i++)
+	{
+		if (counts[i] == 0)
+			continue;
+
+		char name[8];
+		OpcodeName(i, name, sizeof(name));
+		fprintf(f, "%s,%llu,%llu,%.6f\n", name, counts[i], cycles[i], (double)counts[i] / total);
+	}
+}
+
+void OpcodeStats::WriteJSON(FILE* f, const char* indent) const
+{
+	fprintf(f, "{\n%s\t\"instructions\": %llu,\n%s\t\"opcodes\": {", indent, Total(), indent);
+
+	bool first = true;
+	for (size_t i = 0; i < counts.size(); i++)
+	{
+		if (counts[i] == 0)
+			continue;
+
+		char name[8];
+		OpcodeName(i, name, sizeof(name));
+		fprintf(f, "%s\n%s\t\t\"%s\": {\"count\": %llu, \"cycles\": %llu}", first ? "" : ",", indent, name, counts[i], cycles[i]);
+		first = false;
+	}
+
+	fprintf(f, "\n%s\t}\n%s}", indent, indent);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <array>
+#include "util.hpp"
+
+// How often every opcode ran and how many cycles it took in total. 0x000-0x0FF are the normal ones,
+// 0x100-0x1FF the CB prefixed ones. The CPU only counts these if it was compiled with OPCODE_STATS
+// (see CPU::opcodeStats), otherwise none of this costs anything. One set per CPU, nothing atomic,
+// batch runs add them up once everyone is done
+struct OpcodeStats
+{
+	std::array<QWORD, 0x200> counts = { };
+	std::array<QWORD, 0x200> cycles = { };
+
+	inline void Count(WORD opcode, BYTE taken)
+	{
+		counts[opcode]++;
+		cycles[opcode] += taken;
+	}
+
+	void Add(const OpcodeStats& other);
+	QWORD Total() const;
+
+	bool Save(const char* filename) const;		// CSV, or JSON if the name ends in .json
+	void WriteCSV(FILE* f) const;
+	void WriteJSON(FILE* f, const char* indent) const;		// Just the object, so it can go into bigger JSON files
+};
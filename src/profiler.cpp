@@ -0,0 +1,186 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <errno.h>
+
+#include "bus.hpp"
+
+Profiler::Profiler(QWORD interval) :
+	interval(std::max(1ull, interval))
+{
+}
+
+void Profiler::Start(Bus& b)
+{
+	bus = &b;
+	bus->cpu->profiler = this;
+	bus->scheduler.Schedule(Event::Profile, bus->internalCounter + interval);
+}
+
+void Profiler::Stop()
+{
+	if (bus == nullptr)
+		return;
+
+	bus->cpu->profiler = nullptr;
+	bus->scheduler.Cancel(Event::Profile);
+	bus = nullptr;
+}
+
+void Profiler::Clear()
+{
+	samples = 0;
+	locations.clear();
+	stacks.clear();
+	frames.clear();
+}
+
+bool Profiler::LoadSymbols(const char* filename)
+{
+	FILE* f = fopen(filename, "r");
+	if (f == nullptr)
+	{
+		EXIT_MSG("Failed to open %s", filename);
+		return false;
+	}
+
+	// Every line is "bank:address name", comments start with a semicolon
+	char line[512];
+	while (fgets(line, sizeof(line), f) != nullptr)
+	{
+		unsigned int bank, addr;
+		char name[256];
+		if (line[0] == ';' || sscanf(line, "%x:%x %255s", &bank, &addr, name) != 3)
+			continue;
+
+		// Local labels (Function.loop) would split the samples of one function up
+		if (strchr(name, '.') == nullptr)
+			symbols[((bank & 0xFFFF) << 16) | (addr & 0xFFFF)] = name;
+	}
+
+	fclose(f);
+	return true;
+}
+
+std::string Profiler::Name(DWORD location, bool offset) const
+{
+	auto it = symbols.upper_bound(location);
+	if (it != symbols.begin() && ((--it)->first >> 16) == (location >> 16))
+	{
+		if (!offset || it->first == location)
+			return it->second;
+
+		char suffix[16];
+		snprintf(suffix, sizeof(suffix), "+$%x", location - it->first);
+		return it->second + suffix;
+	}
+
+	char name[16];
+	if (location >> 16)
+		snprintf(name, sizeof(name), "$%02x:%04x", location >> 16, location & 0xFFFF);
+	else
+		snprintf(name, sizeof(name), "$%04x", location);
+
+	return name;
+}
+
+DWORD Profiler::Locate(WORD addr) const
+{
+	// Only the switchable bank needs to say which one it is
+	if (addr >= 0x4000 && addr < 0x8000)
+		return ((DWORD)bus->ROMBank() << 16) | addr;
+
+	return addr;
+}
+
+void Profiler::Sample()
+{
+	CPU& cpu = *bus->cpu;
+	DWORD location = Locate(cpu.PC.w);
+
+	samples++;
+	locations[location]++;
+	if (!trackCalls)
+		return;
+
+	// Whatever the stack pointer left behind won't be returned from anymore
+	while (!frames.empty() && frames.back().sp < cpu.SP.w)
+		frames.pop_back();
+
+	stack.clear();
+	for (const ProfilerFrame& frame : frames)
+		stack.push_back(frame.function);
+
+	stack.push_back(location);
+	stacks[stack]++;
+}
+
+void Profiler::Call(WORD target, WORD sp)
+{
+	if (!trackCalls)
+		return;
+
+	// Calls that happened deeper down the stack than this one are long gone (or never returned)
+	while (!frames.empty() && frames.back().sp <= sp)
+		frames.pop_back();
+
+	if (frames.size() < PROFILER_MAX_DEPTH)
+		frames.push_back({ Locate(target), sp });
+}
+
+void Profiler::Return(WORD sp)
+{
+	if (!trackCalls)
+		return;
+
+	while (!frames.empty() && frames.back().sp < sp)
+		frames.pop_back();
+}
+
+bool Profiler::SaveCollapsed(const char* filename) const
+{
+	FILE* f = fopen(filename, "w");
+	if (f == nullptr)
+	{
+		EXIT_MSG("Failed to open %s", filename);
+		return false;
+	}
+
+	// Without the calls every sample is its own little stack. Either way the names can repeat
+	// (several addresses in one function), flamegraph.pl adds those up by itself
+	std::map<std::string, QWORD> lines;
+	if (stacks.empty())
+	{
+		for (const auto& [location, count] : locations)
+			lines[Name(location, false)] += count;
+	}
+
+	for (const auto& [frames, count] : stacks)
+	{
+		std::string line;
+		for (DWORD function : frames)
+			line += (line.empty() ? "" : ";") + Name(function, false);
+
+		lines[line] += count;
+	}
+
+	for (const auto& [line, count] : lines)
+		fprintf(f, "%s %llu\n", line.c_str(), count);
+
+	fclose(f);
+	return true;
+}
+
+std::vector<std::pair<std::string, QWORD>> Profiler::Top(size_t n) const
+{
+	std::map<std::string, QWORD> functions;
+	for (const auto& [location, count] : locations)
+		functions[Name(location, false)] += count;
+
+	std::vector<std::pair<std::string, QWORD>> top(functions.begin(), functions.end());
+	std::sort(top.begin(), top.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+	if (top.size() > n)
+		top.resize(n);
+
+	return top;
+}
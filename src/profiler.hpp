@@ -0,0 +1,60 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "util.hpp"
+
+class Bus;
+
+#define PROFILER_DEFAULT_INTERVAL	4096		// Cycles between samples, so about 1000 per emulated second
+#define PROFILER_MAX_DEPTH			64			// Calls nested deeper than this aren't tracked
+
+// A function that was called and hasn't returned yet
+struct ProfilerFrame
+{
+	DWORD function;			// Bank << 16 | address, like everything else in here
+	WORD sp;				// Where its return address is on the stack
+};
+
+// Looks at where the CPU is every few thousand cycles (as a scheduled event, so it costs nothing in
+// between) and counts how often it found it where. Optionally also keeps track of CALLs and RETs
+// to tell which functions it was in. Names come from RGBDS .sym files if there is one
+class Profiler
+{
+public:
+	Profiler(QWORD interval = PROFILER_DEFAULT_INTERVAL);
+
+	void Start(Bus& bus);		// Attaches to the bus' CPU and schedules the first sample
+	void Stop();
+	void Clear();
+
+	bool LoadSymbols(const char* filename);
+	std::string Name(DWORD location, bool offset) const;		// Symbol (+ offset) or just the address
+
+	void Sample();
+	void Call(WORD target, WORD sp);		// Called by the CPU right after it jumped to the target
+	void Return(WORD sp);					// And right after it popped the return address
+
+	bool SaveCollapsed(const char* filename) const;		// "outer;inner;... samples" per line, for flamegraph.pl & co
+	std::vector<std::pair<std::string, QWORD>> Top(size_t n) const;		// Most sampled functions (or addresses)
+
+public:
+	QWORD interval;
+	bool trackCalls = false;	// Off by default, not all code CALLs and RETs like it should
+	QWORD samples = 0;
+
+private:
+	DWORD Locate(WORD addr) const;
+
+private:
+	Bus* bus = nullptr;
+
+	std::unordered_map<DWORD, QWORD> locations;		// Samples per location
+	std::map<std::vector<DWORD>, QWORD> stacks;		// Samples per call stack, outermost first
+	std::vector<ProfilerFrame> frames;
+	std::vector<DWORD> stack;						// Scratch space for building the key above
+
+	std::map<DWORD, std::string> symbols;
+};
@@ -1,10 +1,12 @@
 #pragma once
 
+#include <array>
 #include <vector>
-#include <memory>
+#include <variant>
 #include "util.hpp"
 
-#include "mbcs/Imbc.hpp"
+#include "mbcs/mbc0.hpp"
+#include "mbcs/mbc1.hpp"
 
 class Bus;
 
@@ -17,11 +19,21 @@ public:
 	BYTE Read(WORD addr);
 	void Write(WORD addr, BYTE val);
 
+	const std::vector<BYTE>& Data() const { return data; }
+	QWORD Hash() const;		// Fingerprint of the whole ROM, to tell if something was made for this one
+
+	// Fill in the bus page tables for ROM and cartridge RAM with wherever the banks are right now
+	void MapPages(std::array<BYTE*, 0x100>& readPages, std::array<BYTE*, 0x100>& writePages);
+
+private:
+	template<typename MBC>
+	void MapPages(MBC& m, std::array<BYTE*, 0x100>& readPages, std::array<BYTE*, 0x100>& writePages);
+
 	friend class Bus;
 
 private:
 	Bus* bus;
-	std::unique_ptr<IMBC> mbc;
+	std::variant<MBC0, MBC1> mbc;		// Picked once when the cartridge is loaded, so every access knows which MBC it's talking to
 
 	std::vector<BYTE> data, ram;
 };
\ No newline at end of file
@@ -0,0 +1,49 @@
+#include "scheduler.hpp"
+
+Scheduler::Scheduler()
+{
+	timestamps.fill(NEVER);
+	next = NEVER;
+}
+
+void Scheduler::Schedule(Event event, QWORD cycle)
+{
+	timestamps[(size_t)event] = cycle;
+	UpdateNext();
+}
+
+void Scheduler::Cancel(Event event)
+{
+	timestamps[(size_t)event] = NEVER;
+	UpdateNext();
+}
+
+bool Scheduler::Pop(QWORD now, Event& event)
+{
+	if (next > now)
+		return false;
+
+	// Events that are due at the same cycle are handed out in the order of the enum
+	for (size_t i = 0; i < timestamps.size(); i++)
+	{
+		if (timestamps[i] == next)
+		{
+			event = (Event)i;
+			timestamps[i] = NEVER;
+			UpdateNext();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void Scheduler::UpdateNext()
+{
+	next = NEVER;
+	for (QWORD timestamp : timestamps)
+	{
+		if (timestamp < next)
+			next = timestamp;
+	}
+}
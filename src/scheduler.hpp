@@ -0,0 +1,41 @@
+#pragma once
+
+#include <array>
+#include "util.hpp"
+
+// Everything that happens at a known point in (emulated) time. The bus runs the CPU
+// until the earliest of these instead of asking every device on every single clock
+// whether it has something to do
+enum class Event
+{
+	Timer,			// TIMA overflows
+	LCD,			// The LCD might raise an interrupt (or it's just time to catch it up)
+	Profile,		// The profiler wants to know where the CPU is. Doesn't change a thing otherwise
+
+	Count
+};
+
+// Timestamp of an event that isn't scheduled
+#define NEVER (~(QWORD)0)
+
+// There's only a handful of event types so a flat array with a cached minimum
+// is way faster than any kind of heap
+class Scheduler
+{
+public:
+	Scheduler();
+
+	void Schedule(Event event, QWORD cycle);	// (Re)schedules the event at the given absolute cycle
+	void Cancel(Event event);
+
+	QWORD Next() const { return next; }			// Cycle of the earliest pending event
+	QWORD When(Event event) const { return timestamps[(size_t)event]; }
+	bool Pop(QWORD now, Event& event);			// Removes one event that's due by now. Returns false if there is none
+
+private:
+	void UpdateNext();
+
+private:
+	std::array<QWORD, (size_t)Event::Count> timestamps;
+	QWORD next;
+};
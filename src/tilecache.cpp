@@ -0,0 +1,81 @@
+#include "tilecache.hpp"
+
+// SSE2 is there on every x86-64 CPU, everyone else gets the plain loop
+#if defined(__SSE2__) || defined(_M_X64)
+	#define TILECACHE_SSE2
+	#include <emmintrin.h>
+#endif
+
+// 16 bytes of tile data in, 64 color indices out
+static void DecodeTile(const BYTE* data, BYTE* pixels)
+{
+#ifdef TILECACHE_SSE2
+	// Every row gets spread out into 8 copies of its low byte followed by 8 copies of its high byte,
+	// then each copy only keeps the bit for its own pixel (the leftmost one is bit 7)
+	const __m128i bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, (char)128, 1, 2, 4, 8, 16, 32, 64, (char)128);
+	const __m128i one = _mm_set1_epi8(1);
+	const __m128i two = _mm_set1_epi8(2);
+
+	__m128i tile = _mm_loadu_si128((const __m128i*)data);
+	__m128i halves[2] = { _mm_unpacklo_epi8(tile, tile), _mm_unpackhi_epi8(tile, tile) };		// Rows 0-3 and 4-7
+
+	for (int half = 0; half < 2; half++)
+	{
+		__m128i quarters[2] = { _mm_unpacklo_epi16(halves[half], halves[half]), _mm_unpackhi_epi16(halves[half], halves[half]) };	// Two rows each
+
+		for (int quarter = 0; quarter < 2; quarter++)
+		{
+			__m128i first = _mm_unpacklo_epi32(quarters[quarter], quarters[quarter]);
+			__m128i second = _mm_unpackhi_epi32(quarters[quarter], quarters[quarter]);
+			first = _mm_cmpeq_epi8(_mm_and_si128(first, bits), bits);
+			second = _mm_cmpeq_epi8(_mm_and_si128(second, bits), bits);
+
+			__m128i lo = _mm_and_si128(_mm_unpacklo_epi64(first, second), one);
+			__m128i hi = _mm_and_si128(_mm_unpackhi_epi64(first, second), two);
+			_mm_storeu_si128((__m128i*)(pixels + (half * 4 + quarter * 2) * 8), _mm_or_si128(lo, hi));
+		}
+	}
+#else
+	for (int y = 0; y < 8; y++)
+	{
+		BYTE lo = data[2 * y];
+		BYTE hi = data[2 * y + 1];
+		for (int x = 0; x < 8; x++)
+			pixels[y * 8 + x] = ((lo >> (7 - x)) & 1) | (((hi >> (7 - x)) & 1) << 1);
+	}
+#endif
+}
+
+void TileCache::Setup(const BYTE* v)
+{
+	vram = v;
+	InvalidateAll();
+}
+
+void TileCache::InvalidateAll()
+{
+	state.fill(0);
+}
+
+void TileCache::Decode(WORD tile, bool xFlip)
+{
+	BYTE* pixels = decoded.data() + tile * 64;
+	if (!(state[tile] & TILE_DECODED))
+	{
+		DecodeTile(vram + tile * 16, pixels);
+		state[tile] |= TILE_DECODED;
+		decodes++;
+	}
+
+	if (!xFlip)
+		return;
+
+	BYTE* mirrored = flipped.data() + tile * 64;
+	for (int y = 0; y < 8; y++)
+	{
+		for (int x = 0; x < 8; x++)
+			mirrored[y * 8 + x] = pixels[y * 8 + 7 - x];
+	}
+
+	state[tile] |= TILE_FLIPPED;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <array>
+#include <cstring>
+#include "util.hpp"
+
+#define TILE_COUNT		512			// All of VRAM, not just the tile data. 8x16 sprites can reach into the maps (see LCD::MixSprites)
+#define TILE_DECODED	0x01
+#define TILE_FLIPPED	0x02
+
+// VRAM tiles, already turned into one color index (0-3) per pixel, one byte each, left to right and
+// top to bottom. The x flipped version only gets made once a sprite actually asks for it. Writes to
+// VRAM throw away the tile they hit, it gets decoded again the next time someone needs it
+class TileCache
+{
+public:
+	void Setup(const BYTE* vram);
+	void InvalidateAll();
+
+	inline void Invalidate(WORD addr)
+	{
+		state[(addr & 0x1FFF) >> 4] = 0;
+	}
+
+	// The 8 pixels of the row whose low byte is at addr (relative to the start of VRAM), packed
+	// into a QWORD so that the leftmost pixel ends up in the lowest byte
+	inline QWORD Row(WORD addr, bool xFlip)
+	{
+		const BYTE* pixels = Pixels((addr & 0x1FFF) >> 4, xFlip) + ((addr >> 1) & 7) * 8;
+
+		QWORD row;
+		memcpy(&row, pixels, sizeof(row));
+		return row;
+	}
+
+	inline const BYTE* Pixels(WORD tile, bool xFlip)
+	{
+		BYTE wanted = xFlip ? TILE_FLIPPED : TILE_DECODED;
+		if (!(state[tile] & wanted))
+			Decode(tile, xFlip);
+
+		return (xFlip ? flipped : decoded).data() + tile * 64;
+	}
+
+public:
+	QWORD decodes = 0;		// How often a tile had to be decoded (again)
+
+private:
+	void Decode(WORD tile, bool xFlip);
+
+private:
+	const BYTE* vram = nullptr;
+
+	std::array<BYTE, TILE_COUNT * 64> decoded;
+	std::array<BYTE, TILE_COUNT * 64> flipped;
+	std::array<BYTE, TILE_COUNT> state = { };
+};
@@ -0,0 +1,70 @@
+#include "trace.hpp"
+
+#include <algorithm>
+#include <errno.h>
+
+Trace::Trace(size_t size)
+{
+	size_t rounded = 1;
+	while (rounded < size)
+		rounded <<= 1;
+
+	entries.resize(rounded);
+	mask = rounded - 1;
+}
+
+void Trace::Clear()
+{
+	recorded = 0;
+}
+
+size_t Trace::Count() const
+{
+	return (size_t)std::min<QWORD>(recorded, entries.size());
+}
+
+bool Trace::Save(const char* filename) const
+{
+	FILE* f = fopen(filename, "wb");
+	if (f == nullptr)
+	{
+		EXIT_MSG("Failed to open %s", filename);
+		return false;
+	}
+
+	TraceHeader header = { TRACE_MAGIC, TRACE_VERSION, sizeof(TraceEntry), (DWORD)Count() };
+	fwrite(&header, sizeof(header), 1, f);
+
+	// Once it went around, the oldest entry is the one that gets overwritten next
+	size_t first = (recorded > entries.size()) ? (size_t)(recorded & mask) : 0;
+	fwrite(entries.data() + first, sizeof(TraceEntry), header.count - first, f);
+	fwrite(entries.data(), sizeof(TraceEntry), first, f);
+
+	bool ok = !ferror(f);
+	fclose(f);
+	return ok;
+}
+
+bool Trace::Load(const char* filename, std::vector<TraceEntry>& entries)
+{
+	FILE* f = fopen(filename, "rb");
+	if (f == nullptr)
+	{
+		EXIT_MSG("Failed to open %s", filename);
+		return false;
+	}
+
+	TraceHeader header;
+	bool ok =
+		fread(&header, sizeof(header), 1, f) == 1 &&
+		header.magic == TRACE_MAGIC && header.version == TRACE_VERSION && header.entrySize == sizeof(TraceEntry);
+
+	if (ok)
+	{
+		entries.resize(header.count);
+		ok = (fread(entries.data(), sizeof(TraceEntry), header.count, f) == header.count);
+	}
+
+	fclose(f);
+	return ok;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <vector>
+#include "util.hpp"
+
+#define TRACE_MAGIC			0x52544259		// "YBTR"
+#define TRACE_VERSION		1
+#define TRACE_DEFAULT_SIZE	(1 << 16)		// Entries, so the last 2 MB worth of instructions
+
+// What an entry is about
+#define TRACE_INSTRUCTION	0
+#define TRACE_INTERRUPT		1		// bytes[0] says which one (0 = V-Blank, ..., 4 = Joypad)
+
+// One instruction (or interrupt), and what the CPU looked like right before it
+struct TraceEntry
+{
+	QWORD cycle;			// Bus cycle it started at
+	WORD pc;
+	WORD af, bc, de, hl, sp;
+	WORD bank;				// ROM bank in $4000-$7FFF
+	BYTE bytes[3];			// Opcode and operands (or the CB prefix and the actual opcode)
+	BYTE kind;
+};
+
+// What a dump starts with, the entries follow oldest first. All of it is in whatever byte
+// order the machine that wrote it uses
+struct TraceHeader
+{
+	DWORD magic;
+	DWORD version;
+	DWORD entrySize;		// sizeof(TraceEntry), in case that ever changes
+	DWORD count;
+};
+
+// Remembers the last however many instructions the CPU ran in a ring buffer. Nothing gets formatted
+// while recording, that's what yabgbe_trace is for. Point CPU::trace at one of these to start
+// recording and set it back to nullptr to stop. Instructions that ran inside of JIT blocks can't
+// be recorded, so the JIT sits it out while that's on
+class Trace
+{
+public:
+	Trace(size_t size = TRACE_DEFAULT_SIZE);		// Rounded up to a power of two
+
+	inline TraceEntry& Next();		// Where the next entry goes. Overwrites the oldest one once it's full
+	void Clear();
+
+	size_t Count() const;
+	bool Save(const char* filename) const;
+	static bool Load(const char* filename, std::vector<TraceEntry>& entries);
+
+private:
+	std::vector<TraceEntry> entries;
+	size_t mask;
+	QWORD recorded = 0;		// Entries so far, including the ones that were overwritten already
+};
+
+inline TraceEntry& Trace::Next()
+{
+	return entries[(recorded++) & mask];
+}
@@ -0,0 +1,213 @@
+#include "trace.hpp"
+
+#include <string.h>
+
+// Turns a trace dump (see trace.hpp, and --trace in main.cpp) back into something a human can read.
+// One line per instruction, with the registers as they were right before it ran
+
+struct Options
+{
+	const char* dump = nullptr;
+	size_t last = 0;		// Only the last this many entries, 0 for all of them
+};
+
+static const char* r[8] = { "B", "C", "D", "E", "H", "L", "(HL)", "A" };
+static const char* rp[4] = { "BC", "DE", "HL", "SP" };
+static const char* rp2[4] = { "BC", "DE", "HL", "AF" };
+static const char* cc[4] = { "NZ", "Z", "NC", "C" };
+static const char* alu[8] = { "ADD A, ", "ADC A, ", "SUB ", "SBC A, ", "AND ", "XOR ", "OR ", "CP " };
+static const char* rot[8] = { "RLC", "RRC", "RL", "RR", "SLA", "SRA", "SWAP", "SRL" };
+static const char* x0z7[8] = { "RLCA", "RRCA", "RLA", "RRA", "DAA", "CPL", "SCF", "CCF" };
+static const char* interrupts[5] = { "V-Blank", "LCD STAT", "Timer", "Serial", "Joypad" };
+
+// Same x/y/z/p/q split the CPU decodes with. Returns how long the instruction is
+static int Disassemble(const BYTE* bytes, WORD pc, char* out, size_t size)
+{
+	BYTE op = bytes[0];
+	BYTE x = op >> 6, y = (op >> 3) & 7, z = op & 7, p = y >> 1, q = y & 1;
+	BYTE n = bytes[1];
+	WORD nn = bytes[1] | (bytes[2] << 8);
+	WORD target = pc + 2 + (signed char)n;
+
+	if (op == 0xCB)
+	{
+		BYTE cb = bytes[1];
+		BYTE cx = cb >> 6, cy = (cb >> 3) & 7, cz = cb & 7;
+		if (cx == 0)
+			snprintf(out, size, "%s %s", rot[cy], r[cz]);
+		else
+			snprintf(out, size, "%s %u, %s", (cx == 1) ? "BIT" : ((cx == 2) ? "RES" : "SET"), cy, r[cz]);
+
+		return 2;
+	}
+
+	if (x == 1)
+	{
+		if (op == 0x76)
+			snprintf(out, size, "HALT");
+		else
+			snprintf(out, size, "LD %s, %s", r[y], r[z]);
+
+		return 1;
+	}
+
+	if (x == 2)
+	{
+		snprintf(out, size, "%s%s", alu[y], r[z]);
+		return 1;
+	}
+
+	if (x == 0)
+	{
+		switch (z)
+		{
+		case 0:
+			if (y == 0)			{ snprintf(out, size, "NOP");							return 1; }
+			if (y == 1)			{ snprintf(out, size, "LD ($%04x), SP", nn);				return 3; }
+			if (y == 2)			{ snprintf(out, size, "STOP");							return 1; }
+			if (y == 3)			{ snprintf(out, size, "JR $%04x", target);				return 2; }
+			snprintf(out, size, "JR %s, $%04x", cc[y - 4], target);
+			return 2;
+
+		case 1:
+			if (q == 0)			{ snprintf(out, size, "LD %s, $%04x", rp[p], nn);			return 3; }
+			snprintf(out, size, "ADD HL, %s", rp[p]);
+			return 1;
+
+		case 2:
+		{
+			static const char* indirect[4] = { "(BC)", "(DE)", "(HL+)", "(HL-)" };
+			if (q == 0)
+				snprintf(out, size, "LD %s, A", indirect[p]);
+			else
+				snprintf(out, size, "LD A, %s", indirect[p]);
+
+			return 1;
+		}
+
+		case 3:		snprintf(out, size, "%s %s", q ? "DEC" : "INC", rp[p]);		return 1;
+		case 4:		snprintf(out, size, "INC %s", r[y]);							return 1;
+		case 5:		snprintf(out, size, "DEC %s", r[y]);							return 1;
+		case 6:		snprintf(out, size, "LD %s, $%02x", r[y], n);					return 2;
+		default:	snprintf(out, size, "%s", x0z7[y]);								return 1;
+		}
+	}
+
+	switch (z)
+	{
+	case 0:
+		if (y < 4)			{ snprintf(out, size, "RET %s", cc[y]);					return 1; }
+		if (y == 4)			{ snprintf(out, size, "LD ($ff%02x), A", n);				return 2; }
+		if (y == 5)			{ snprintf(out, size, "ADD SP, %d", (signed char)n);		return 2; }
+		if (y == 6)			{ snprintf(out, size, "LD A, ($ff%02x)", n);				return 2; }
+		snprintf(out, size, "LD HL, SP%+d", (signed char)n);
+		return 2;
+
+	case 1:
+	{
+		static const char* other[4] = { "RET", "RETI", "JP HL", "LD SP, HL" };
+		if (q == 0)
+			snprintf(out, size, "POP %s", rp2[p]);
+		else
+			snprintf(out, size, "%s", other[p]);
+
+		return 1;
+	}
+
+	case 2:
+		if (y < 4)			{ snprintf(out, size, "JP %s, $%04x", cc[y], nn);		return 3; }
+		if (y == 4)			{ snprintf(out, size, "LD ($ff00+C), A");				return 1; }
+		if (y == 5)			{ snprintf(out, size, "LD ($%04x), A", nn);				return 3; }
+		if (y == 6)			{ snprintf(out, size, "LD A, ($ff00+C)");				return 1; }
+		snprintf(out, size, "LD A, ($%04x)", nn);
+		return 3;
+
+	case 3:
+		if (y == 0)			{ snprintf(out, size, "JP $%04x", nn);					return 3; }
+		if (y == 6)			{ snprintf(out, size, "DI");								return 1; }
+		if (y == 7)			{ snprintf(out, size, "EI");								return 1; }
+		break;
+
+	case 4:
+		if (y < 4)			{ snprintf(out, size, "CALL %s, $%04x", cc[y], nn);		return 3; }
+		break;
+
+	case 5:
+		if (q == 0)			{ snprintf(out, size, "PUSH %s", rp2[p]);				return 1; }
+		if (p == 0)			{ snprintf(out, size, "CALL $%04x", nn);					return 3; }
+		break;
+
+	case 6:		snprintf(out, size, "%s$%02x", alu[y], n);		return 2;
+	case 7:		snprintf(out, size, "RST $%02x", y * 8);			return 1;
+	}
+
+	snprintf(out, size, "??? ($%02x)", op);
+	return 1;
+}
+
+static void PrintUsage()
+{
+	fprintf(stderr, "Usage: yabgbe_trace [--last N] <DUMP>\n");
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	for (int i = 1; i < argc; i++)
+	{
+		bool hasValue = (i + 1 < argc);
+
+		if (!strcmp(argv[i], "--last") && hasValue)
+			options.last = strtoull(argv[++i], nullptr, 10);
+		else if (argv[i][0] != '-' && options.dump == nullptr)
+			options.dump = argv[i];
+		else
+		{
+			PrintUsage();
+			return -1;
+		}
+	}
+
+	if (options.dump == nullptr)
+	{
+		PrintUsage();
+		return -1;
+	}
+
+	std::vector<TraceEntry> entries;
+	if (!Trace::Load(options.dump, entries))
+	{
+		fprintf(stderr, "%s isn't a trace this version of yabgbe can read\n", options.dump);
+		return -1;
+	}
+
+	size_t first = (options.last != 0 && options.last < entries.size()) ? entries.size() - options.last : 0;
+	for (size_t i = first; i < entries.size(); i++)
+	{
+		const TraceEntry& entry = entries[i];
+		if (entry.kind == TRACE_INTERRUPT)
+		{
+			BYTE type = entry.bytes[0];
+			printf("[%12llu] -- %s interrupt --\n", entry.cycle, (type < 5) ? interrupts[type] : "???");
+			continue;
+		}
+
+		char text[32];
+		int length = Disassemble(entry.bytes, entry.pc, text, sizeof(text));
+
+		char raw[12] = "";
+		for (int b = 0; b < length; b++)
+			snprintf(raw + b * 3, sizeof(raw) - b * 3, "%02x ", entry.bytes[b]);
+
+		// Only the switchable bank needs saying which one it is
+		printf("[%12llu] ", entry.cycle);
+		if (entry.pc >= 0x4000 && entry.pc < 0x8000)
+			printf("%02x:%04x  ", entry.bank, entry.pc);
+		else
+			printf("   %04x  ", entry.pc);
+
+		printf("%-9s %-20s AF: %04x  BC: %04x  DE: %04x  HL: %04x  SP: %04x\n", raw, text, entry.af, entry.bc, entry.de, entry.hl, entry.sp);
+	}
+
+	return 0;
+}
@@ -15,5 +15,3 @@ typedef unsigned long long	QWORD;
 	fprintf(stderr, "%s\n", strerror(errno)); \
 	fprintf(stderr, "Exiting.\n"); \
 }
-
-inline BYTE undefined;
\ No newline at end of file